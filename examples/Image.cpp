@@ -56,9 +56,12 @@ void Image::scale(int newWidth, int newHeight)&
     if (width()==newWidth && height()==newHeight)
         return;
 
-    // The following line triggers a copy if necessary.
-    d->width = newWidth;
-    d->height = newHeight;
+    // Builds the scaled data straight from the shared source, instead of
+    // copying it first and then overwriting the copy.
+    d.detach_with([=](const ImageData& source)
+    {
+        return ImageData(newWidth, newHeight, source.colorSpace);
+    });
 }
 
 Image Image::scaled(int width, int height)const&
@@ -0,0 +1,173 @@
+/*
+Copyright(c) 2016 Bjoern Piltz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files(the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+#include "COW.h"
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+
+namespace cow {
+
+/**
+ * A request scoped arena for COW payloads.
+ *
+ * While an arena_scope is alive, every payload that the current thread
+ * allocates with the default allocator (constructed, or copied by detach())
+ * is placed in a monotonic buffer instead of the heap. Releasing a payload
+ * only runs its destructor; the memory is freed in one go when the scope
+ * ends.
+ *
+ *   void handleRequest(const Request& request)
+ *   {
+ *       cow::arena_scope arena;
+ *       ...// Thousands of short lived COW objects.
+ *   }
+ *
+ * No payload may outlive the scope it was allocated in, so results that
+ * have to escape must be created before the scope or copied to plain
+ * values. Debug builds assert this when the scope ends.
+ *
+ * Scopes nest, and must be destroyed in reverse order on the thread that
+ * created them. Payloads may be handed to and released on other threads,
+ * as long as that happens before the scope ends.
+ */
+class arena_scope final : private detail::Arena
+{
+public:
+    // Allocates chunks of at least chunkSize bytes from the heap.
+    explicit arena_scope(std::size_t chunkSize = 64*1024) noexcept;
+    // Uses buffer first, e.g. one on the stack, and heap chunks after that.
+    arena_scope(void* buffer, std::size_t size) noexcept;
+    ~arena_scope();
+
+    arena_scope(const arena_scope&) = delete;
+    arena_scope& operator=(const arena_scope&) = delete;
+
+    // The number of bytes handed out so far.
+    std::size_t bytes_used()const noexcept;
+    // The number of payloads placed here that are still alive.
+    std::size_t live()const noexcept;
+
+private:
+    struct Chunk
+    {
+        Chunk* next;
+    };
+
+    void* allocate(std::size_t size, std::size_t alignment) override;
+    void released() noexcept override;
+    bool scoped()const noexcept override;
+
+    Arena* previous;
+    char* cursor;
+    char* end;
+    Chunk* chunks;
+    std::size_t chunkSize;
+    std::size_t used;
+    std::atomic<std::size_t> alive;// Released on any thread.
+};
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//                    Implementation details follow:                        //
+//////////////////////////////////////////////////////////////////////////////
+
+inline arena_scope::arena_scope(std::size_t chunkSize) noexcept
+    : arena_scope(nullptr, 0)
+{
+    this->chunkSize = chunkSize;
+}
+
+inline arena_scope::arena_scope(void* buffer, std::size_t size) noexcept
+    : previous(current())
+    , cursor(static_cast<char*>(buffer))
+    , end(static_cast<char*>(buffer) + size)
+    , chunks(nullptr)
+    , chunkSize(64*1024)
+    , used(0)
+    , alive(0)
+{
+    current() = this;
+}
+
+inline arena_scope::~arena_scope()
+{
+    assert(alive.load(std::memory_order_acquire) == 0 && "A COW payload allocated in an arena_scope outlived it");
+    assert(current() == this && "arena_scopes must be destroyed in reverse order");
+    current() = previous;
+    while (chunks)
+    {
+        Chunk* next = chunks->next;
+        std::free(chunks);
+        chunks = next;
+    }
+}
+
+inline std::size_t arena_scope::bytes_used()const noexcept
+{
+    return used;
+}
+
+inline std::size_t arena_scope::live()const noexcept
+{
+    return alive.load(std::memory_order_acquire);
+}
+
+inline void* arena_scope::allocate(std::size_t size, std::size_t alignment)
+{
+    std::size_t padding = std::size_t(-reinterpret_cast<std::uintptr_t>(cursor)) & (alignment - 1);
+    if (!cursor || padding + size > std::size_t(end - cursor))
+    {
+        // Chunks grow, so that large requests need few of them.
+        const std::size_t needed = sizeof(Chunk) + alignment + size;
+        const std::size_t bytes = needed > chunkSize ? needed : chunkSize;
+        Chunk* chunk = static_cast<Chunk*>(std::malloc(bytes));
+        if (!chunk)
+            throw std::bad_alloc();
+        chunk->next = chunks;
+        chunks = chunk;
+        chunkSize *= 2;
+        cursor = reinterpret_cast<char*>(chunk + 1);
+        end = reinterpret_cast<char*>(chunk) + bytes;
+        padding = std::size_t(-reinterpret_cast<std::uintptr_t>(cursor)) & (alignment - 1);
+    }
+    void* result = cursor + padding;
+    cursor += padding + size;
+    used += padding + size;
+    alive.fetch_add(1, std::memory_order_relaxed);
+    return result;
+}
+
+inline void arena_scope::released() noexcept
+{
+    alive.fetch_sub(1, std::memory_order_release);
+}
+
+inline bool arena_scope::scoped()const noexcept
+{
+    return true;
+}
+
+}// namespace cow
@@ -0,0 +1,362 @@
+/*
+Copyright(c) 2016 Bjoern Piltz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files(the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+#include "COW.h"
+#include "Epoch.h"
+#include <cstdint>
+#include <exception>
+
+// Whether AtomicCOW may keep its ticket count in the upper 16 bits of a
+// 64 bit word holding a pointer. That needs pointers that leave those bits
+// clear: on 32 bit platforms, and on x86-64, where user space addresses
+// have 47 bits (with 5-level paging, Linux only maps above that on
+// request). Elsewhere, e.g. on AArch64, where the top byte of a pointer may
+// carry a tag (TBI, MTE), load() counts its reference inside an epoch
+// instead. Define it as 0 to force that, or as 1 if a platform is known to
+// be safe.
+#ifndef COW_ATOMIC_PACKED_POINTERS
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define COW_ATOMIC_PACKED_POINTERS 1
+#else
+#define COW_ATOMIC_PACKED_POINTERS 0
+#endif
+#endif
+
+/**
+ * A cell holding a COW<T> that can be read and replaced concurrently,
+ * e.g. to publish configuration or lookup tables. It replaces the mutex
+ * around a shared COW<T>.
+ *
+ *   AtomicCOW<Config> config;
+ *
+ *   // Readers take a snapshot, which stays valid however often the
+ *   // cell is replaced afterwards.
+ *   COW<Config> snapshot = config.load();
+ *
+ *   // Writers publish a new value...
+ *   config.store(COW<Config>(loadConfig()));
+ *
+ *   // ...or modify the current one (read-copy-update).
+ *   config.update([](COW<Config>& c) { c->verbose = true; });
+ *
+ * load() is wait-free and never blocks writers. It is normally a single
+ * atomic increment. This works by charging the payload's count with a
+ * batch of references when it is stored. Each load() claims one of them by
+ * incrementing a ticket count kept in the unused upper bits of the stored
+ * pointer. Writers hand unclaimed references back when they replace the
+ * payload, and a reader that claims the middle of a batch tops it up.
+ *
+ * When a whole batch is claimed before it could be topped up (which takes
+ * thousands of threads), and always on platforms where pointers may use
+ * their upper bits (see COW_ATOMIC_PACKED_POINTERS), load() counts a
+ * reference of its own inside an epoch section instead, as borrow() below
+ * does.
+ *
+ * store(), exchange() and compare_exchange() are lock-free (see below for
+ * the one exception).
+ *
+ * Readers that only need a look at the payload can skip even that
+ * increment with borrow(), which returns a plain reference that stays
+ * valid while the given cow::epoch_guard is alive (see Epoch.h):
+ *
+ *   cow::epoch_guard guard;
+ *   const Config& c = config.borrow(guard);
+ *
+ * Once a cell has been read inside an epoch section, writers hand the
+ * reference of a replaced payload to the epoch instead of dropping it, so
+ * the payload is destroyed once all sections that might see it have ended.
+ * Handing it over takes a mutex shared by all cells. It is only ever held
+ * by writers and cow::epoch::collect(), never by readers.
+ */
+template<typename T>
+class AtomicCOW final
+{
+    static_assert(!cow::inline_storage<T>::value, "AtomicCOW needs shared payloads");
+
+public:
+    AtomicCOW() noexcept(noexcept(T()));
+    explicit AtomicCOW(COW<T> value) noexcept;
+    ~AtomicCOW();
+
+    AtomicCOW(const AtomicCOW&) = delete;
+    AtomicCOW& operator=(const AtomicCOW&) = delete;
+
+    COW<T> load()const noexcept;
+    const T& borrow(const cow::epoch_guard& guard)const noexcept;
+    void store(COW<T> value);
+    COW<T> exchange(COW<T> value);
+
+    // Replaces the stored value with desired if it still points to the same
+    // payload as expected. Otherwise expected is set to the current value.
+    bool compare_exchange(COW<T>& expected, COW<T> desired);
+
+    // Read-copy-update: calls function(COW<T>&) with a snapshot of the
+    // current value and publishes the result, retrying if another writer
+    // got there first. Writing through the handle detaches it as usual, so
+    // the payload is only copied if function actually modifies it.
+    // Returns the value that was published (or left in place).
+    template<typename F>
+    COW<T> update(F function);
+
+private:
+    typedef typename COW<T>::Header Header;
+    typedef std::uint64_t Word;
+
+    static const bool Packed = COW_ATOMIC_PACKED_POINTERS;
+    static const int PointerBits = sizeof(void*) == 8 ? 48 : 32;
+    static const Word PointerMask = Packed ? (Word(1) << PointerBits) - 1 : ~Word(0);
+    static const Word Ticket = Word(1) << PointerBits;
+    static const int Batch = 1 << 14;
+
+    static Word pack(Header* header) noexcept;
+    static Header* pointer(Word word) noexcept;
+    static int tickets(Word word) noexcept;
+
+    static void charge(Header* header, int count) noexcept;
+    static void discharge(Header* header, int count) noexcept;
+    // Takes the reference held by value, and charges it with a batch.
+    static Word publish(COW<T>& value) noexcept;
+    // Returns the references that were charged but never claimed.
+    static Header* retire(Word word) noexcept;
+    void refill(Header* header)const noexcept;
+    // The current payload, which stays alive while guard does.
+    Header* protect(const cow::epoch_guard& guard)const noexcept;
+    // Takes over the reference the cell held on a replaced payload.
+    COW<T> replaced(Header* header)const;
+    static void deferredRelease(void* header);
+
+    mutable std::atomic<Word> word;
+    mutable std::atomic<bool> borrowed;
+};
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//                    Implementation details follow:                        //
+//////////////////////////////////////////////////////////////////////////////
+
+template<typename T>
+inline AtomicCOW<T>::AtomicCOW() noexcept(noexcept(T()))
+    : AtomicCOW(COW<T>())
+{
+}
+
+template<typename T>
+inline AtomicCOW<T>::AtomicCOW(COW<T> value) noexcept
+    : word(publish(value))
+    , borrowed(false)
+{
+}
+
+template<typename T>
+inline AtomicCOW<T>::~AtomicCOW()
+{
+    cow::detail::release(retire(word.load(std::memory_order_acquire)));
+}
+
+template<typename T>
+inline COW<T> AtomicCOW<T>::load()const noexcept
+{
+    // Reading first keeps readers from running the ticket count up while
+    // the batch is out.
+    if (Packed && tickets(word.load(std::memory_order_relaxed)) < Batch)
+    {
+        const Word old = word.fetch_add(Ticket, std::memory_order_acquire);
+        const int ticket = tickets(old);
+        if (ticket < Batch)
+        {
+            if (ticket >= Batch/2)
+                refill(pointer(old));
+            return COW<T>(pointer(old), cow::detail::Adopt());
+        }
+    }
+    // No ticket: count a reference of our own, while the epoch keeps the
+    // payload alive. Then top the batch up for the readers after us.
+    const cow::epoch_guard guard;
+    Header* header = protect(guard);
+    cow::detail::retain(header);
+    if (Packed)
+        refill(header);
+    return COW<T>(header, cow::detail::Adopt());
+}
+
+template<typename T>
+inline const T& AtomicCOW<T>::borrow(const cow::epoch_guard& guard)const noexcept
+{
+    return static_cast<const typename COW<T>::Block*>(protect(guard))->value;
+}
+
+template<typename T>
+inline typename AtomicCOW<T>::Header* AtomicCOW<T>::protect(const cow::epoch_guard&)const noexcept
+{
+    // Both sides use sequentially consistent operations: either a writer
+    // sees the flag, or we see what it stored.
+    if (!borrowed.load(std::memory_order_seq_cst))
+        borrowed.store(true, std::memory_order_seq_cst);
+    return pointer(word.load(std::memory_order_seq_cst));
+}
+
+template<typename T>
+inline void AtomicCOW<T>::store(COW<T> value)
+{
+    exchange(std::move(value));
+}
+
+template<typename T>
+inline COW<T> AtomicCOW<T>::exchange(COW<T> value)
+{
+    const Word old = word.exchange(publish(value), std::memory_order_seq_cst);
+    return replaced(retire(old));
+}
+
+template<typename T>
+inline bool AtomicCOW<T>::compare_exchange(COW<T>& expected, COW<T> desired)
+{
+    const Word replacement = publish(desired);
+    Word current = word.load(std::memory_order_relaxed);
+    while (pointer(current) == expected.pointer)
+    {
+        // Only fails on the pointer, or if readers took tickets meanwhile.
+        if (word.compare_exchange_weak(current, replacement, std::memory_order_seq_cst, std::memory_order_relaxed))
+        {
+            replaced(retire(current));
+            return true;
+        }
+    }
+    // Undo publish(): desired gets its reference back and returns the batch.
+    desired.pointer = retire(replacement);
+    expected = load();
+    return false;
+}
+
+template<typename T>
+template<typename F>
+inline COW<T> AtomicCOW<T>::update(F function)
+{
+    COW<T> current = load();
+    for (;;)
+    {
+        COW<T> next = current;
+        function(next);
+        if (next.pointer == current.pointer)
+            return current;
+        if (compare_exchange(current, next))
+            return next;
+    }
+}
+
+template<typename T>
+inline typename AtomicCOW<T>::Word AtomicCOW<T>::pack(Header* header) noexcept
+{
+    return Word(reinterpret_cast<std::uintptr_t>(header));
+}
+
+template<typename T>
+inline typename AtomicCOW<T>::Header* AtomicCOW<T>::pointer(Word word) noexcept
+{
+    return reinterpret_cast<Header*>(std::uintptr_t(word & PointerMask));
+}
+
+template<typename T>
+inline int AtomicCOW<T>::tickets(Word word) noexcept
+{
+    return Packed ? int(word >> PointerBits) : 0;
+}
+
+template<typename T>
+inline COW<T> AtomicCOW<T>::replaced(Header* header)const
+{
+    if (!borrowed.load(std::memory_order_seq_cst) || header->immortal())
+        return COW<T>(header, cow::detail::Adopt());
+
+    // Borrowers may still be looking at it.
+    cow::detail::retain(header);
+    cow::epoch::retire(header, &AtomicCOW::deferredRelease);
+    return COW<T>(header, cow::detail::Adopt());
+}
+
+template<typename T>
+inline void AtomicCOW<T>::deferredRelease(void* header)
+{
+    cow::detail::release(static_cast<Header*>(header));
+}
+
+template<typename T>
+inline void AtomicCOW<T>::charge(Header* header, int count) noexcept
+{
+    if (!header->immortal())
+        header->count.fetch_add(count, std::memory_order_relaxed);
+}
+
+template<typename T>
+inline void AtomicCOW<T>::discharge(Header* header, int count) noexcept
+{
+    // Callers always keep at least one reference.
+    if (!header->immortal())
+        header->count.fetch_sub(count, std::memory_order_relaxed);
+}
+
+template<typename T>
+inline typename AtomicCOW<T>::Word AtomicCOW<T>::publish(COW<T>& value) noexcept
+{
+    Header* header = value.pointer;
+    value.pointer = nullptr;
+    // A pointer using the ticket bits would be corrupted, with no way out.
+    if (pointer(pack(header)) != header)
+        std::terminate();
+    if (Packed)
+        charge(header, Batch);
+    return pack(header);
+}
+
+template<typename T>
+inline typename AtomicCOW<T>::Header* AtomicCOW<T>::retire(Word word) noexcept
+{
+    Header* header = pointer(word);
+    const int claimed = tickets(word) < Batch ? tickets(word) : Batch;
+    if (Packed && claimed < Batch)
+        discharge(header, Batch - claimed);
+    return header;
+}
+
+template<typename T>
+inline void AtomicCOW<T>::refill(Header* header)const noexcept
+{
+    // We hold a reference, so header is alive. Charge first: a writer may
+    // retire the current batch at any moment.
+    Word current = word.load(std::memory_order_relaxed);
+    if (pointer(current) != header || tickets(current) < Batch/2)
+        return;
+    charge(header, Batch/2);
+    do
+    {
+        const int claimed = tickets(current) < Batch ? tickets(current) : Batch;
+        const Word refilled = (current & PointerMask) | (Word(claimed - Batch/2) << PointerBits);
+        if (word.compare_exchange_weak(current, refilled, std::memory_order_relaxed, std::memory_order_relaxed))
+            return;
+    }
+    while (pointer(current) == header && tickets(current) >= Batch/2);
+
+    // Someone else topped it up, or a writer retired it.
+    discharge(header, Batch/2);
+}
@@ -0,0 +1,299 @@
+/*
+Copyright(c) 2016 Bjoern Piltz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files(the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+#include "COW.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iterator>
+
+namespace cow {
+
+/**
+ * Makes every handle in [first, last) unique, like calling detach() on
+ * each, but places all the copies in one heap allocation, contiguously and
+ * in iteration order:
+ *
+ *   std::vector<COW<Pixel>> pixels = original;
+ *   cow::detach_all(pixels.begin(), pixels.end());
+ *   for (auto& pixel : pixels)
+ *       pixel->value *= 2;// No allocations, and good locality.
+ *
+ * Releasing one of the copies only runs its destructor. The allocation is
+ * freed with the last of them, so a single long lived copy keeps all of it.
+ * Handles with a non-default allocator are detached one by one, and
+ * handles that are already unique are left alone.
+ */
+template<typename Iterator>
+void detach_all(Iterator first, Iterator last);
+
+// What cow::compact() did.
+struct compact_stats
+{
+    std::size_t payloads;   // Payloads moved.
+    std::size_t bytes_moved;// Their total size, sizeof(T) each.
+};
+
+/**
+ * Moves the payloads of the handles in [first, last) that are uniquely
+ * owned into one new allocation, contiguously and in iteration order, and
+ * points the handles at them. Shared payloads stay where they are, as do
+ * ones with a non-default allocator.
+ *
+ * Payloads that were allocated at different times end up scattered over
+ * the heap. Compacting long lived collections now and then restores the
+ * locality of a freshly built one, for code that iterates over them:
+ *
+ *   const cow::compact_stats stats = cow::compact(table.begin(), table.end());
+ *
+ * Payloads are moved if their move constructor can't throw, and copied
+ * otherwise. References to the payloads and running edit() guards are
+ * invalidated. The new allocation is freed with the last payload in it, as
+ * with detach_all().
+ */
+template<typename Iterator>
+compact_stats compact(Iterator first, Iterator last);
+
+namespace detail {
+
+// The allocation behind one detach_all() or compact() call. It starts with
+// this object, which counts the payloads placed in it and frees it with the
+// last one.
+class Batch final : private Arena
+{
+public:
+    template<typename Iterator, typename T, typename Policy, typename Alloc>
+    static void detach(Iterator first, Iterator last, COW<T, Policy, Alloc, false>*);
+    template<typename Iterator, typename T, typename Policy, typename Alloc>
+    static void detach(Iterator, Iterator, COW<T, Policy, Alloc, true>*) noexcept
+    {
+        // Inline payloads are never shared.
+    }
+
+    template<typename Iterator, typename T, typename Policy, typename Alloc>
+    static compact_stats compact(Iterator first, Iterator last, COW<T, Policy, Alloc, false>*);
+    template<typename Iterator, typename T, typename Policy, typename Alloc>
+    static compact_stats compact(Iterator, Iterator, COW<T, Policy, Alloc, true>*) noexcept
+    {
+        return compact_stats{0, 0};// Inline payloads live in their handles.
+    }
+
+private:
+    explicit Batch(char* end) noexcept;
+
+    // A batch with room for the given number of blocks.
+    template<typename Block>
+    static Batch* create(std::size_t blocks);
+
+    template<typename Iterator, typename T, typename Policy, typename Alloc>
+    static void detachEach(Iterator first, Iterator last, COW<T, Policy, Alloc, false>*, std::true_type);
+    template<typename Iterator, typename T, typename Policy, typename Alloc>
+    static void detachEach(Iterator first, Iterator last, COW<T, Policy, Alloc, false>*, std::false_type);
+
+    // Shared, and not moved-from.
+    template<typename Policy>
+    static bool detachable(const BlockHeader<Policy>* header) noexcept
+    {
+        return header && !unique(header);
+    }
+
+    // Uniquely owned, and neither moved-from nor frozen or static.
+    template<typename Policy>
+    static bool relocatable(const BlockHeader<Policy>* header) noexcept
+    {
+        return header && !header->immortal() && unique(header);
+    }
+
+    void* allocate(std::size_t size, std::size_t alignment) override;
+    void released() noexcept override;
+    bool scoped()const noexcept override;
+
+    char* cursor;
+    char* end;
+    std::atomic<std::size_t> alive;// Payloads, plus one while detaching.
+};
+
+}// namespace detail
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//                    Implementation details follow:                        //
+//////////////////////////////////////////////////////////////////////////////
+
+template<typename Iterator>
+inline void detach_all(Iterator first, Iterator last)
+{
+    typedef typename std::iterator_traits<Iterator>::value_type Handle;
+    detail::Batch::detach(first, last, static_cast<Handle*>(nullptr));
+}
+
+template<typename Iterator>
+inline compact_stats compact(Iterator first, Iterator last)
+{
+    typedef typename std::iterator_traits<Iterator>::value_type Handle;
+    return detail::Batch::compact(first, last, static_cast<Handle*>(nullptr));
+}
+
+namespace detail {
+
+inline Batch::Batch(char* end) noexcept
+    : cursor(reinterpret_cast<char*>(this + 1))
+    , end(end)
+    , alive(1)
+{
+}
+
+template<typename Iterator, typename T, typename Policy, typename Alloc>
+inline void Batch::detach(Iterator first, Iterator last, COW<T, Policy, Alloc, false>* handle)
+{
+    detachEach(first, last, handle, std::is_same<Alloc, typename default_allocator<T>::type>());
+}
+
+// Other allocators decide where payloads go, so the batch can't be used.
+template<typename Iterator, typename T, typename Policy, typename Alloc>
+inline void Batch::detachEach(Iterator first, Iterator last, COW<T, Policy, Alloc, false>*, std::false_type)
+{
+    for (; first != last; ++first)
+        first->detach();
+}
+
+template<typename Iterator, typename T, typename Policy, typename Alloc>
+inline void Batch::detachEach(Iterator first, Iterator last, COW<T, Policy, Alloc, false>*, std::true_type)
+{
+    typedef typename COW<T, Policy, Alloc, false>::Block Block;
+
+    std::size_t shared = 0;
+    for (Iterator it = first; it != last; ++it)
+    {
+        if (detachable(it->pointer))
+            ++shared;
+    }
+    if (!shared)
+        return;
+
+    // Handles sharing a payload with each other may turn unique as the
+    // others detach, so this may be more than needed.
+    Batch* batch = create<Block>(shared);
+    try
+    {
+        for (; first != last; ++first)
+        {
+            if (!detachable(first->pointer))
+                continue;
+            Block* block = static_cast<Block*>(first->pointer);
+            Block* copy = Block::createInArena(*batch, block->allocator(), Clone<T>::copy(block->value));
+            release(first->pointer);
+            first->pointer = copy;
+        }
+    }
+    catch (...)
+    {
+        batch->released();
+        throw;
+    }
+    batch->released();
+}
+
+template<typename Iterator, typename T, typename Policy, typename Alloc>
+inline compact_stats Batch::compact(Iterator first, Iterator last, COW<T, Policy, Alloc, false>*)
+{
+    typedef typename COW<T, Policy, Alloc, false>::Block Block;
+    compact_stats stats{0, 0};
+    if (!std::is_same<Alloc, typename default_allocator<T>::type>::value)
+        return stats;
+
+    for (Iterator it = first; it != last; ++it)
+    {
+        if (relocatable(it->pointer))
+        {
+            assertNotBorrowed(it->pointer);
+            ++stats.payloads;
+        }
+    }
+    if (!stats.payloads)
+        return stats;
+
+    Batch* batch = create<Block>(stats.payloads);
+    try
+    {
+        for (; first != last; ++first)
+        {
+            if (!relocatable(first->pointer))
+                continue;
+            Block* block = static_cast<Block*>(first->pointer);
+            Block* moved = Block::createInArena(*batch, block->allocator(), std::move_if_noexcept(block->value));
+            release(first->pointer);
+            first->pointer = moved;
+        }
+    }
+    catch (...)
+    {
+        batch->released();
+        throw;
+    }
+    batch->released();
+    stats.bytes_moved = stats.payloads*sizeof(T);
+    return stats;
+}
+
+template<typename Block>
+inline Batch* Batch::create(std::size_t blocks)
+{
+    // malloc() aligns for std::max_align_t only.
+    static_assert(alignof(Block) <= alignof(std::max_align_t), "over aligned types are not supported");
+    const std::size_t alignment = alignof(Block) > alignof(Arena*) ? alignof(Block) : alignof(Arena*);
+    const std::size_t bytes = sizeof(Batch) + alignment + blocks*(Block::ArenaPrefix + sizeof(Block));
+    char* memory = static_cast<char*>(std::malloc(bytes));
+    if (!memory)
+        throw std::bad_alloc();
+    return ::new(memory) Batch(memory + bytes);
+}
+
+inline void* Batch::allocate(std::size_t size, std::size_t alignment)
+{
+    const std::size_t padding = std::size_t(-reinterpret_cast<std::uintptr_t>(cursor)) & (alignment - 1);
+    if (padding + size > std::size_t(end - cursor))
+        throw std::bad_alloc();// Not reached, detach() sized the batch.
+    void* result = cursor + padding;
+    cursor += padding + size;
+    alive.fetch_add(1, std::memory_order_relaxed);
+    return result;
+}
+
+inline void Batch::released() noexcept
+{
+    if (alive.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        this->~Batch();
+        std::free(this);
+    }
+}
+
+inline bool Batch::scoped()const noexcept
+{
+    return false;
+}
+
+}// namespace detail
+}// namespace cow
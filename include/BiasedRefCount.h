@@ -0,0 +1,386 @@
+/*
+Copyright(c) 2016 Bjoern Piltz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files(the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+#include "COW.h"
+#include <mutex>
+
+namespace cow {
+
+/**
+ * Biased reference counting: COW<T, cow::biased>.
+ *
+ * The thread that creates a payload owns its count. On that thread copies
+ * and releases update a local count with plain loads and stores. Other
+ * threads update a separate atomic shared count. This is a good fit when
+ * payloads are mostly copied and released where they were created and only
+ * sometimes handed to other threads.
+ *
+ * When the local count drops to zero the owner gives up ownership and
+ * merges both counts, after which all threads use the shared count.
+ *
+ * A non-owning thread releasing a reference that only the owner counted
+ * (the shared count is zero) cannot decrement anything itself. It queues
+ * the release for the owner instead, which applies it on its next release
+ * of any biased payload, in collect(), or when it exits. Payloads may
+ * therefore be destroyed somewhat later than with cow::multi_thread.
+ *
+ * Handles are as thread safe as with the default policy.
+ */
+struct biased
+{
+    struct counter;
+
+    // Per thread bookkeeping. Records are never freed: once neither their
+    // thread nor an unmerged counter uses them, they are recycled.
+    struct thread_record
+    {
+        thread_record(bool alive, int users) noexcept
+            : queue(nullptr), alive(alive), pending(false), users(users), nextFree(nullptr)
+        {
+        }
+        std::mutex mutex;
+        counter* queue;          // Releases deferred by other threads, guarded by mutex.
+        bool alive;              // Guarded by mutex.
+        std::atomic<bool> pending;
+        std::atomic<int> users;  // The thread itself plus every unmerged counter it owns.
+        thread_record* nextFree;
+    };
+
+    struct counter
+    {
+        explicit counter(int initial);
+
+        std::atomic<thread_record*> owner;// Null once merged.
+        std::atomic<int> local;           // Only written by the owner, or under its mutex once it exited.
+                                          // Decrements are release stores, see load().
+        std::atomic<int> shared;          // Twice the count, plus the Merged flag.
+        int deferred;                     // Queued releases, guarded by the owner's mutex.
+        counter* next;                    // Links the owner's queue.
+    };
+
+    static void increment(counter& count) noexcept;
+    static bool decrement(counter& count) noexcept;
+    static int load(const counter& count) noexcept;
+
+    // Applies the releases other threads queued for payloads owned by the
+    // calling thread. Call it from owner threads that stop using COW for a
+    // long time but keep running.
+    static void collect() noexcept;
+
+private:
+    enum { Merged = 1, One = 2 };
+
+    static thread_record*& slot() noexcept;
+    static thread_record* current() noexcept;
+    static thread_record* attach();
+    static void detach(thread_record* record) noexcept;
+    static thread_record& exited() noexcept;
+    static std::mutex& freeListMutex() noexcept;
+    static thread_record*& freeList() noexcept;
+    static void releaseUser(thread_record* record) noexcept;
+
+    static bool merge(counter& count, int adjust) noexcept;
+    static counter* drain(thread_record* record, bool exiting = false) noexcept;
+    static bool decrementShared(counter& count) noexcept;
+    static void destroy(counter* list) noexcept;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+//                    Implementation details follow:                        //
+//////////////////////////////////////////////////////////////////////////////
+
+inline biased::counter::counter(int initial)
+    : owner(initial ? current() : nullptr)
+    , local(initial)
+    , shared(0)
+    , deferred(0)
+    , next(nullptr)
+{
+    // Every exited thread shares the same record, so it can't own counters:
+    // they start out merged instead.
+    if (owner.load(std::memory_order_relaxed) == &exited())
+    {
+        owner.store(nullptr, std::memory_order_relaxed);
+        local.store(0, std::memory_order_relaxed);
+        shared.store(Merged + One*initial, std::memory_order_relaxed);
+    }
+    else if (initial)
+        owner.load(std::memory_order_relaxed)->users.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline void biased::increment(counter& count) noexcept
+{
+    if (count.owner.load(std::memory_order_relaxed) == current())
+        count.local.store(count.local.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    else
+        count.shared.fetch_add(One, std::memory_order_relaxed);
+}
+
+inline bool biased::decrement(counter& count) noexcept
+{
+    thread_record* me = current();
+    if (count.owner.load(std::memory_order_relaxed) != me)
+        return decrementShared(count);
+
+    // Released, so that a thread that sees the count drop through load()
+    // also sees everything the owner did with the payload before.
+    const int local = count.local.load(std::memory_order_relaxed) - 1;
+    count.local.store(local, std::memory_order_release);
+    const bool last = local == 0 && merge(count, 0);
+
+    // A good moment to apply releases queued by other threads.
+    if (me->pending.load(std::memory_order_relaxed))
+        destroy(drain(me));
+    return last;
+}
+
+inline int biased::load(const counter& count) noexcept
+{
+    return count.local.load(std::memory_order_acquire)
+        + count.shared.load(std::memory_order_acquire)/One;
+}
+
+inline void biased::collect() noexcept
+{
+    thread_record* me = current();
+    if (me->pending.load(std::memory_order_relaxed))
+        destroy(drain(me));
+}
+
+// Called by the owner, or under the owner's mutex once it exited. Folds the
+// local count, plus adjust, into the shared count. Returns true if that
+// released the last reference.
+inline bool biased::merge(counter& count, int adjust) noexcept
+{
+    thread_record* owner = count.owner.load(std::memory_order_relaxed);
+    count.owner.store(nullptr, std::memory_order_relaxed);
+    const int local = count.local.load(std::memory_order_relaxed) + adjust;
+    count.local.store(0, std::memory_order_relaxed);
+    const int shared = count.shared.fetch_add(Merged + One*local, std::memory_order_acq_rel) + Merged + One*local;
+
+    // Alive owners hold a user reference for their thread, so only exited
+    // owners can be recycled here.
+    if (owner->users.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        releaseUser(owner);
+    return shared == Merged;
+}
+
+inline bool biased::decrementShared(counter& count) noexcept
+{
+    int shared = count.shared.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        if (shared & Merged)
+            return count.shared.fetch_sub(One, std::memory_order_acq_rel) == One + Merged;
+
+        // Counts are interchangeable, so any shared reference can be dropped.
+        if (shared >= One)
+        {
+            if (count.shared.compare_exchange_weak(shared, shared - One, std::memory_order_acq_rel, std::memory_order_relaxed))
+                return false;
+            continue;
+        }
+
+        // Our reference is only counted by the owner.
+        thread_record* owner = count.owner.load(std::memory_order_acquire);
+        if (!owner)
+        {
+            shared = count.shared.load(std::memory_order_relaxed);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(owner->mutex);
+        if (count.owner.load(std::memory_order_relaxed) != owner)
+        {
+            lock.unlock();
+            shared = count.shared.load(std::memory_order_relaxed);
+            continue;
+        }
+        if (owner->alive)
+        {
+            if (count.deferred++ == 0)
+            {
+                count.next = owner->queue;
+                owner->queue = &count;
+            }
+            owner->pending.store(true, std::memory_order_relaxed);
+            return false;
+        }
+
+        // The owner exited and can no longer touch its local count, so we
+        // do it for it, under its mutex.
+        const int local = count.local.load(std::memory_order_relaxed) - 1;
+        count.local.store(local, std::memory_order_release);
+        if (local != 0)
+            return false;
+        owner->users.fetch_add(1, std::memory_order_relaxed);// Keep it while we hold its mutex.
+        const bool last = merge(count, 0);
+        lock.unlock();
+        if (owner->users.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            releaseUser(owner);
+        return last;
+    }
+}
+
+// Applies the queued releases. Returns the counters that dropped to zero,
+// linked through next, so that they can be destroyed without holding the mutex.
+// An exiting owner stops accepting releases in the same critical section.
+inline biased::counter* biased::drain(thread_record* record, bool exiting) noexcept
+{
+    counter* dead = nullptr;
+    std::lock_guard<std::mutex> lock(record->mutex);
+    record->pending.store(false, std::memory_order_relaxed);
+    if (exiting)
+        record->alive = false;
+    counter* queue = record->queue;
+    record->queue = nullptr;
+    while (queue)
+    {
+        counter& count = *queue;
+        queue = count.next;
+        const int deferred = count.deferred;
+        count.deferred = 0;
+
+        bool last;
+        if (count.owner.load(std::memory_order_relaxed) == record)
+        {
+            const int local = count.local.load(std::memory_order_relaxed) - deferred;
+            if (local > 0)
+            {
+                count.local.store(local, std::memory_order_release);
+                continue;
+            }
+            last = merge(count, -deferred);
+        }
+        else
+        {
+            // Merged after the releases were queued.
+            last = count.shared.fetch_sub(One*deferred, std::memory_order_acq_rel) == One*deferred + Merged;
+        }
+        if (last)
+        {
+            count.next = dead;
+            dead = &count;
+        }
+    }
+    return dead;
+}
+
+inline biased::thread_record*& biased::slot() noexcept
+{
+    static thread_local thread_record* record = nullptr;
+    return record;
+}
+
+inline biased::thread_record* biased::current() noexcept
+{
+    thread_record*& record = slot();
+    if (!record)
+        record = attach();
+    return record;
+}
+
+inline biased::thread_record* biased::attach()
+{
+    // Hands the record back when the thread exits. Handles released later
+    // on this thread, e.g. by other thread_local objects, see the exited()
+    // record instead and take the slow path.
+    struct Detacher
+    {
+        thread_record* record = nullptr;
+        ~Detacher()
+        {
+            if (record)
+                detach(record);
+        }
+    };
+    static thread_local Detacher detacher;
+
+    thread_record* record;
+    {
+        std::lock_guard<std::mutex> lock(freeListMutex());
+        record = freeList();
+        if (record)
+            freeList() = record->nextFree;
+    }
+    if (!record)
+        record = new thread_record(true, 0);
+    {
+        std::lock_guard<std::mutex> lock(record->mutex);
+        record->alive = true;
+        record->nextFree = nullptr;
+    }
+    record->users.store(1, std::memory_order_relaxed);
+    detacher.record = record;
+    return record;
+}
+
+inline void biased::detach(thread_record* record) noexcept
+{
+    // Once alive is false, other threads apply their releases themselves.
+    destroy(drain(record, true));
+    slot() = &exited();
+    if (record->users.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        releaseUser(record);
+}
+
+inline biased::thread_record& biased::exited() noexcept
+{
+    // Never alive, and its extra user keeps it from being recycled.
+    static thread_record record(false, 1);
+    return record;
+}
+
+inline std::mutex& biased::freeListMutex() noexcept
+{
+    static std::mutex mutex;
+    return mutex;
+}
+
+inline biased::thread_record*& biased::freeList() noexcept
+{
+    static thread_record* list = nullptr;
+    return list;
+}
+
+// Called once a record has no users left.
+inline void biased::releaseUser(thread_record* record) noexcept
+{
+    std::lock_guard<std::mutex> lock(freeListMutex());
+    record->nextFree = freeList();
+    freeList() = record;
+}
+
+inline void biased::destroy(counter* list) noexcept
+{
+    typedef detail::BlockHeader<biased> Header;
+    static_assert(std::is_standard_layout<Header>::value, "the counter must be the first member of the header");
+    while (list)
+    {
+        counter* count = list;
+        list = list->next;
+        Header* header = reinterpret_cast<Header*>(count);
+        header->destroy(header);
+    }
+}
+
+}// namespace cow
@@ -21,7 +21,608 @@ SOFTWARE.
 */
 
 #pragma once
+#include <atomic>
+#include <cassert>
+#include <cstddef>
 #include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+template<typename T, typename Policy, typename Alloc, bool Inline> class COW;
+
+namespace cow {
+
+/**
+ * Specialize inline_storage for payloads that are cheaper to copy than to
+ * share. COW then stores them inside the handle and copies them along with
+ * it, behind the same interface:
+ *
+ *   template<> struct cow::inline_storage<Point> : cow::fits_inline<Point> {};
+ *
+ * or, e.g., ": std::is_trivially_copyable<Point> {}". The type has to be
+ * complete wherever the handle is, so this doesn't mix with opaque pointers.
+ */
+template<typename T>
+struct inline_storage : std::false_type {};
+
+// True for payloads no larger than MaxSize bytes.
+template<typename T, std::size_t MaxSize = 2*sizeof(void*)>
+struct fits_inline : std::integral_constant<bool, sizeof(T) <= MaxSize> {};
+
+/**
+ * Specialize slab_allocated as true to allocate T's payload blocks from a
+ * per type, thread caching slab allocator by default (see Slab.h, which
+ * must be included where the specialization is):
+ *
+ *   template<> struct cow::slab_allocated<Message> : std::true_type {};
+ */
+template<typename T>
+struct slab_allocated : std::false_type {};
+
+template<typename T>
+class slab_allocator;
+
+template<typename T, typename Policy, typename Alloc, typename Hash, typename Equal>
+class intern_pool;// See InternPool.h.
+
+/**
+ * Specialize deferred_detach as true to make reads through a non-const
+ * handle free: its operator-> then returns a const pointer and never
+ * detaches. Writes go through data(), edit(), or per member proxies:
+ *
+ *   template<> struct cow::deferred_detach<struct Private> : std::true_type {};
+ *
+ *   if (d->size != size)        // reads the shared payload
+ *       d.field(&Private::size) = size;// detaches, then writes
+ *
+ * Unlike inline_storage, this works with forward declared types, as long
+ * as the specialization is visible wherever the handle is.
+ */
+template<typename T>
+struct deferred_detach : std::false_type {};
+
+// The allocator COW<T> uses unless given another one.
+template<typename T>
+struct default_allocator
+{
+    typedef typename std::conditional<slab_allocated<T>::value,
+        slab_allocator<T>, std::allocator<T>>::type type;
+};
+
+/**
+ * Reference counting policies, selected by the second template argument
+ * of COW. A policy defines the counter type stored next to the payload and
+ * how it is incremented, decremented and read.
+ *
+ * See BiasedRefCount.h for cow::biased, StickyRefCount.h for cow::sticky
+ * and ShardedRefCount.h for cow::sharded.
+ */
+
+// The default: atomic counters, handles may be shared between threads.
+struct multi_thread
+{
+    typedef std::atomic<int> counter;
+
+    static void increment(counter& count) noexcept
+    {
+        count.fetch_add(1, std::memory_order_relaxed);
+    }
+    // Returns true if the last reference was released.
+    static bool decrement(counter& count) noexcept
+    {
+        return count.fetch_sub(1, std::memory_order_acq_rel) == 1;
+    }
+    static int load(const counter& count) noexcept
+    {
+        return count.load(std::memory_order_acquire);
+    }
+};
+
+// Plain integer counters without any lock-prefixed instructions.
+// Handles sharing a payload must never be used from more than one thread.
+struct single_thread
+{
+    typedef int counter;
+
+    static void increment(counter& count) noexcept
+    {
+        ++count;
+    }
+    static bool decrement(counter& count) noexcept
+    {
+        return --count == 0;
+    }
+    static int load(const counter& count) noexcept
+    {
+        return count;
+    }
+};
+
+namespace detail {
+
+// Every payload lives in a heap block that starts with this header.
+// The handle only stores a pointer to the header, so copying, assigning
+// and destroying a COW never needs the payload type to be complete.
+template<typename Policy>
+struct BlockHeader
+{
+    typedef void (*Destroy)(BlockHeader*);
+
+    constexpr explicit BlockHeader(Destroy destroy)
+        : count(destroy ? 1 : 0)
+        , borrows(0)
+        , destroy(destroy)
+    {
+    }
+    // Immortal blocks are never counted, so their count stays at zero, which
+    // also makes detach() treat them as shared without an extra test.
+    bool immortal()const noexcept
+    {
+        return destroy == nullptr;
+    }
+    typename Policy::counter count;
+    // Live cow::borrowed views of a mortal block, only counted by debug
+    // builds. It is there in all builds, so they agree on the layout, and
+    // mostly fills the padding after count.
+    std::atomic<int> borrows;
+    Destroy destroy;// Deletes the block, set where the payload type is known.
+                    // Only cleared by COW::freeze(), while the block is unique.
+};
+
+struct Immortal {};
+struct Adopt {};
+struct InArena {};
+
+class Batch;// See Batch.h.
+
+// The interface of cow::arena_scope (see Arena.h). While a scope is active
+// on a thread, payloads using the default allocator are placed in it.
+class Arena
+{
+public:
+    virtual void* allocate(std::size_t size, std::size_t alignment) = 0;
+    virtual void released() noexcept = 0;// A block placed here was destroyed.
+    // True for a cow::arena_scope, whose blocks must not outlive it. Batches
+    // of detach_all() and compact() live as long as their blocks.
+    virtual bool scoped()const noexcept = 0;
+
+    static Arena*& current() noexcept
+    {
+        static thread_local Arena* arena = nullptr;
+        return arena;
+    }
+
+protected:
+    ~Arena() = default;
+};
+
+// Holds the allocator of a block, taking no space if it is empty.
+template<typename Allocator, bool Empty = std::is_empty<Allocator>::value,
+    bool Stateless = Empty && std::is_default_constructible<Allocator>::value>
+struct AllocatorHolder : private Allocator
+{
+    AllocatorHolder()
+        : Allocator()
+    {
+    }
+    explicit AllocatorHolder(const Allocator& allocator) noexcept
+        : Allocator(allocator)
+    {
+    }
+    const Allocator& allocator()const noexcept
+    {
+        return *this;
+    }
+};
+
+// Empty allocators that can be default constructed, like std::allocator,
+// are made when needed. Not constructing one keeps immortal blocks
+// constant initializable, see cow::static_payload.
+template<typename Allocator>
+struct AllocatorHolder<Allocator, true, true>
+{
+    constexpr AllocatorHolder() noexcept
+    {
+    }
+    explicit AllocatorHolder(const Allocator&) noexcept
+    {
+    }
+    Allocator allocator()const noexcept
+    {
+        return Allocator();
+    }
+};
+
+template<typename Allocator>
+struct AllocatorHolder<Allocator, false, false>
+{
+    AllocatorHolder()
+        : stored()
+    {
+    }
+    explicit AllocatorHolder(const Allocator& allocator) noexcept
+        : stored(allocator)
+    {
+    }
+    const Allocator& allocator()const noexcept
+    {
+        return stored;
+    }
+    Allocator stored;
+};
+
+template<typename T, typename Policy, typename Alloc>
+struct Block final
+    : BlockHeader<Policy>
+    , AllocatorHolder<typename std::allocator_traits<Alloc>::template rebind_alloc<Block<T, Policy, Alloc>>>
+{
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<Block> Allocator;
+    typedef std::allocator_traits<Allocator> Traits;
+
+    template<typename... Args>
+    explicit Block(const Allocator& allocator, Args&&... args)
+        : BlockHeader<Policy>(&Block::deleteBlock)
+        , AllocatorHolder<Allocator>(allocator)
+        , value(std::forward<Args>(args)...)
+    {
+    }
+    template<typename... Args>
+    Block(InArena, const Allocator& allocator, Args&&... args)
+        : BlockHeader<Policy>(&Block::deleteArenaBlock)
+        , AllocatorHolder<Allocator>(allocator)
+        , value(std::forward<Args>(args)...)
+    {
+    }
+    // static_cast instead of std::forward, which isn't constexpr in C++11.
+    template<typename... Args>
+    constexpr explicit Block(Immortal, Args&&... args)
+        : BlockHeader<Policy>(nullptr)
+        , AllocatorHolder<Allocator>()
+        , value(static_cast<Args&&>(args)...)
+    {
+    }
+    T value;
+
+    // Allocates and constructs a block through the allocator, or in the
+    // current arena if there is one and the allocator is the default.
+    template<typename... Args>
+    static Block* create(const Allocator& allocator, Args&&... args)
+    {
+        if (std::is_same<Alloc, typename default_allocator<T>::type>::value && Arena::current())
+            return createInArena(*Arena::current(), allocator, std::forward<Args>(args)...);
+
+        Allocator copy(allocator);
+        Block* block = Traits::allocate(copy, 1);
+        try
+        {
+            Traits::construct(copy, block, allocator, std::forward<Args>(args)...);
+        }
+        catch (...)
+        {
+            Traits::deallocate(copy, block, 1);
+            throw;
+        }
+        return block;
+    }
+
+    // Arena blocks are preceded by a pointer to their arena.
+    static const std::size_t ArenaPrefix = (sizeof(Arena*) + alignof(Block) - 1)/alignof(Block)*alignof(Block);
+
+    template<typename... Args>
+    static Block* createInArena(Arena& arena, const Allocator& allocator, Args&&... args)
+    {
+        char* memory = static_cast<char*>(arena.allocate(ArenaPrefix + sizeof(Block),
+            alignof(Block) > alignof(Arena*) ? alignof(Block) : alignof(Arena*)));
+        reinterpret_cast<Arena**>(memory + ArenaPrefix)[-1] = &arena;
+        try
+        {
+            return ::new(memory + ArenaPrefix) Block(InArena(), allocator, std::forward<Args>(args)...);
+        }
+        catch (...)
+        {
+            arena.released();
+            throw;
+        }
+    }
+
+    static void deleteBlock(BlockHeader<Policy>* header)
+    {
+        Block* block = static_cast<Block*>(header);
+        Allocator allocator(block->allocator());
+        Traits::destroy(allocator, block);
+        Traits::deallocate(allocator, block, 1);
+    }
+
+    // True for blocks in a cow::arena_scope.
+    static bool scoped(const BlockHeader<Policy>* header) noexcept
+    {
+        return header->destroy == &Block::deleteArenaBlock
+            && reinterpret_cast<Arena* const*>(static_cast<const Block*>(header))[-1]->scoped();
+    }
+
+    static void deleteArenaBlock(BlockHeader<Policy>* header)
+    {
+        Block* block = static_cast<Block*>(header);
+        Arena* arena = reinterpret_cast<Arena**>(block)[-1];
+        block->~Block();
+        arena->released();// The memory goes when the arena does.
+    }
+};
+
+template<typename Policy>
+inline void retain(BlockHeader<Policy>* header) noexcept
+{
+    if (!header->immortal())
+        Policy::increment(header->count);
+}
+
+template<typename Policy>
+inline void release(BlockHeader<Policy>* header) noexcept
+{
+    // header is null for moved-from handles.
+    if (header && !header->immortal() && Policy::decrement(header->count))
+    {
+        assert(header->borrows == 0 && "A cow::borrowed outlived the payload it borrowed");
+        header->destroy(header);
+    }
+}
+
+// Called before a handle writes to or moves from its payload in place,
+// which it only does while the payload is unique. Detaching from a shared
+// payload leaves views of it valid.
+template<typename Policy>
+inline void assertNotBorrowed(const BlockHeader<Policy>* header) noexcept
+{
+    (void)header;
+    assert((!header || header->immortal() || header->borrows == 0) && "A COW with a borrowed payload was written to");
+}
+
+template<typename Policy>
+inline bool unique(const BlockHeader<Policy>* header) noexcept
+{
+    return Policy::load(header->count) == 1;
+}
+
+// The shared null of a block type, the immortal block default constructed
+// handles point to.
+template<typename Block, typename = void>
+struct SharedNull
+{
+    static Block* get() noexcept(noexcept(Block(Immortal())))
+    {
+        // Constructed in place on first use and deliberately never destroyed,
+        // so handles in static storage stay valid during shutdown.
+        static typename std::aligned_storage<sizeof(Block), alignof(Block)>::type storage;
+        static Block* const null{::new(&storage) Block(Immortal())};
+        return null;
+    }
+};
+
+// Trivially destructible payloads whose default value is a constant
+// expression get a constant initialized shared null instead: no guard
+// variable, and COW() becomes a constant expression, so static arrays of
+// handles cost nothing at startup.
+template<typename Block>
+struct SharedNull<Block, typename std::enable_if<(Block(Immortal()), true)>::type>
+{
+    static constexpr Block* get() noexcept
+    {
+        return &null;
+    }
+    static Block null;
+};
+
+template<typename Block>
+Block SharedNull<Block, typename std::enable_if<(Block(Immortal()), true)>::type>::null{Immortal()};
+
+/**
+ * detach() copies the payload with cow_clone(const T&) if overload
+ * resolution finds one through argument dependent lookup, and with T's
+ * copy constructor otherwise. That lets a payload share or skip parts of
+ * itself when a handle detaches, while its ordinary copies stay deep:
+ *
+ *   namespace gfx {
+ *   Image cow_clone(const Image& image);// shares the pixel tiles
+ *   }
+ */
+template<typename T, typename = void>
+struct Clone
+{
+    static const T& copy(const T& value) noexcept
+    {
+        return value;// Copy constructed in the new block.
+    }
+};
+
+template<typename T>
+struct Clone<T, decltype(void(cow_clone(std::declval<const T&>())))>
+{
+    static T copy(const T& value)
+    {
+        return cow_clone(value);
+    }
+};
+
+}// namespace detail
+
+/**
+ * Returned by COW::edit(): write access to a payload that has been detached
+ * once, for a whole block of mutations:
+ *
+ *   auto pixels = image.edit();
+ *   for (int i = 0; i < size; ++i)
+ *       pixels->values[i] = 0;
+ *
+ * The handle must not be copied, assigned or destroyed while the guard is
+ * alive. Debug builds assert that it isn't shared again on every access.
+ */
+template<typename T, typename Policy>
+class edit_guard final
+{
+public:
+    edit_guard(T& value, const detail::BlockHeader<Policy>* header) noexcept
+        : value(value)
+        , header(header)
+    {
+    }
+    edit_guard(edit_guard&& other) noexcept
+        : value(other.value)
+        , header(other.header)
+    {
+    }
+    edit_guard(const edit_guard&) = delete;
+    edit_guard& operator=(const edit_guard&) = delete;
+    ~edit_guard()
+    {
+        check();
+    }
+
+    T* operator->()const noexcept
+    {
+        check();
+        return &value;
+    }
+    T& operator*()const noexcept
+    {
+        check();
+        return value;
+    }
+
+private:
+    void check()const noexcept
+    {
+        // header is null for inline payloads, which are never shared.
+        assert((!header || detail::unique(header)) && "A COW was copied while being edited");
+    }
+    T& value;
+    const detail::BlockHeader<Policy>* header;
+};
+
+/**
+ * Returned by COW::field(): reads a member of the payload without
+ * detaching, and detaches only when it is assigned to.
+ */
+template<typename Handle, typename T, typename M>
+class field_proxy final
+{
+public:
+    field_proxy(Handle& handle, M T::* member) noexcept
+        : handle(handle)
+        , member(member)
+    {
+    }
+
+    const M& get()const noexcept
+    {
+        return handle.constData().*member;
+    }
+    operator const M&()const noexcept
+    {
+        return get();
+    }
+
+    field_proxy& operator=(const M& value)
+    {
+        handle.data().*member = value;
+        return *this;
+    }
+    field_proxy& operator=(M&& value)
+    {
+        handle.data().*member = std::move(value);
+        return *this;
+    }
+    field_proxy& operator=(const field_proxy& other)
+    {
+        return *this = other.get();
+    }
+
+private:
+    Handle& handle;
+    M T::* const member;
+};
+
+/**
+ * An immortal payload in static storage, for COW<T>::fromStatic():
+ *
+ *   static const cow::static_payload<Table> defaults(16, 0.5f);
+ *
+ *   COW<Table> table = COW<Table>::fromStatic(defaults);
+ *
+ * Handles to it are never counted and writes detach, as with freeze(), but
+ * nothing is allocated. If T's constructor is constexpr for the given
+ * arguments and T is trivially destructible, the payload is constant
+ * initialized. Otherwise it is initialized like any other static, and as
+ * the shared null it is never destroyed.
+ */
+template<typename T, typename Policy = multi_thread, typename Alloc = typename default_allocator<T>::type>
+class static_payload final
+{
+public:
+    template<typename... Args>
+    constexpr explicit static_payload(Args&&... args)
+        : block(detail::Immortal(), static_cast<Args&&>(args)...)
+    {
+    }
+    ~static_payload()
+    {
+    }
+    static_payload(const static_payload&) = delete;
+    static_payload& operator=(const static_payload&) = delete;
+
+    const T& get()const noexcept
+    {
+        return block.value;
+    }
+
+private:
+    union
+    {
+        detail::Block<T, Policy, Alloc> block;
+    };
+    template<typename, typename, typename, bool> friend class ::COW;
+};
+
+/**
+ * A view of a payload that doesn't own it, returned by COW::borrow(). It
+ * costs a single pointer and no reference counting, which makes it a cheap
+ * way to pass a COW's payload to functions:
+ *
+ *   void draw(cow::borrowed<Style> style);
+ *
+ *   draw(widget.style.borrow());
+ *
+ * The payload must outlive it and must not be written to in place in the
+ * meantime. Debug builds assert both. Handles sharing the payload may be
+ * written to, because they detach first. to_owned() makes a handle
+ * that shares the payload, e.g. to keep it beyond the call.
+ */
+template<typename T, typename Policy = multi_thread, typename Alloc = typename default_allocator<T>::type>
+class borrowed final
+{
+public:
+    borrowed(const borrowed& other) noexcept;
+    borrowed& operator=(const borrowed& other) noexcept;
+    ~borrowed();
+
+    const T* operator->()const noexcept;
+    const T& operator*()const noexcept;
+    const T& get()const noexcept;
+
+    COW<T, Policy, Alloc, false> to_owned()const noexcept;
+
+private:
+    typedef detail::BlockHeader<Policy> Header;
+    typedef detail::Block<T, Policy, Alloc> Block;
+
+    explicit borrowed(Header* header) noexcept;
+    void track(int borrows)const noexcept;
+
+    Header* header;
+    template<typename, typename, typename, bool> friend class ::COW;
+};
+
+}// namespace cow
 
 /**
  * This is an implementation of the copy-on write idiom 
@@ -66,109 +667,676 @@ SOFTWARE.
  * TODO: document exception safety, re-entrancy(i.e. thread safety)
  * 
  * The class is safe to use in a multi threaded environment since we 
- * use atomic counters for the reference counting.
+ * use atomic counters for the reference counting. Code that never shares
+ * handles between threads can use COW<T, cow::single_thread> instead,
+ * which counts with plain integers.
  *
  * The class is exception safe, provided the class T can make the
  * same promise.
  *
- * The class has the binary footprint of two pointers and the default constructor
- * does not allocate any memory on the heap. (all default constructed objects point to
- * the same static sharedNull object)
+ * The class has the binary footprint of a single pointer. The reference count
+ * lives in the same heap block as the payload (intrusive reference counting),
+ * so there is no separate control block, no weak count and no deleter object.
+ * The default constructor does not allocate any memory on the heap. (all
+ * default constructed objects point to the same static sharedNull object)
+ * The shared null is immortal: it is never reference counted and never
+ * destroyed, so default constructing and destroying a COW touches no
+ * shared counter and scales with the number of threads.
+ *
+ * Payloads are allocated with std::allocator by default, or with
+ * cow::slab_allocator for types marked with cow::slab_allocated. Pass a different
+ * allocator type as the third template argument, and an allocator object
+ * with std::allocator_arg, to place them elsewhere. Stateful allocators are
+ * stored in the payload's block, and detached copies are allocated with the
+ * allocator of the payload they were copied from.
+ *
+ * Payloads using the default allocator go to the innermost cow::arena_scope
+ * of the thread if there is one (see Arena.h).
+ *
+ * detach() copies payloads with an ADL found cow_clone(const T&) if there
+ * is one (see cow::detail::Clone).
+ *
+ * A moved-from COW may only be assigned to or destroyed.
  */
-template<typename T>
+template<typename T> class AtomicCOW;
+
+template<typename T, typename Policy = cow::multi_thread, typename Alloc = typename cow::default_allocator<T>::type,
+    bool Inline = cow::inline_storage<T>::value>
 class COW final
 {
 public:
-    COW() noexcept(noexcept(T()));
+    constexpr COW() noexcept(noexcept(T()));
 
-    template<typename Arg0, typename... Args>
+    template<typename Arg0, typename... Args, typename = typename std::enable_if<
+        !std::is_same<typename std::decay<Arg0>::type, COW>::value &&
+        !std::is_same<typename std::decay<Arg0>::type, std::allocator_arg_t>::value>::type>
     explicit COW(Arg0&& arg0, Args&& ... args);// Forwarding constructor
 
-          T* operator->();
+    // Allocates the payload, and all detached copies of it, with allocator.
+    template<typename... Args>
+    COW(std::allocator_arg_t, const Alloc& allocator, Args&& ... args);
+
+    COW(const COW& other) noexcept;
+    COW(COW&& other) noexcept;
+    COW& operator=(const COW& other) noexcept;
+    COW& operator=(COW&& other) noexcept;
+    ~COW();
+
+    // A const pointer, without detaching, if T is cow::deferred_detach.
+    typedef typename std::conditional<cow::deferred_detach<T>::value, const T*, T*>::type Arrow;
+
+          Arrow operator->();
     const T* operator->()const noexcept;
 
           T& data();
     const T& constData()const noexcept;
 
+    // Detaches only when the returned proxy is assigned to.
+    template<typename M, typename U = T>
+    cow::field_proxy<COW, U, M> field(M U::* member) noexcept;
+
     void swap(COW&& other)noexcept;
     void detach();
 
+    // Makes the payload immortal: copying and destroying handles to it no
+    // longer touches its count, and writes always detach. The payload is
+    // never destroyed, so this is meant for data that lives as long as the
+    // program, e.g. tables built at startup. Don't freeze payloads that live
+    // in an arena_scope.
+    void freeze();
+    bool frozen()const noexcept;
+
+    // A view of the payload without a reference. See cow::borrowed.
+    cow::borrowed<T, Policy, Alloc> borrow()const noexcept;
+
+    // A handle to a payload in static storage, which it never counts or
+    // frees, without allocating. Writes detach. See cow::static_payload.
+    static COW fromStatic(const cow::static_payload<T, Policy, Alloc>& payload) noexcept;
+
+    // Moves the payload out if it is unique, copies it if it is shared, and
+    // leaves the handle default constructed.
+    T take()&&;
+
+    // Replaces the payload with transform(constData()), without copying it
+    // first when it is shared. A unique payload is move assigned the result.
+    template<typename F>
+    T& detach_with(F transform);
+
+    // Detaches once, for a block of writes. See cow::edit_guard.
+    cow::edit_guard<T, Policy> edit();
+
+    // Replace the whole payload. A unique payload is reused in place, a
+    // shared one is left alone and the new value built in a new block.
+    T& assign(const T& value);
+    T& assign(T&& value);
+    // Rebuilds a unique payload from args in its block, if that can't throw
+    // half way. Otherwise the new value goes to a new block.
+    template<typename... Args>
+    T& emplace(Args&&... args);
+
+    Alloc get_allocator()const noexcept;
+
 private:
-    std::shared_ptr<T> pointer;
-    static const std::shared_ptr<T>& sharedNull() noexcept(noexcept(T()));
+    typedef cow::detail::BlockHeader<Policy> Header;
+    typedef cow::detail::Block<T, Policy, Alloc> Block;
+
+    Header* pointer;
+    static constexpr Header* sharedNull() noexcept(noexcept(T()));
+
+    // Takes over a reference the caller already counted.
+    COW(Header* pointer, cow::detail::Adopt) noexcept;
+
+    T* arrow(std::false_type);
+    const T* arrow(std::true_type)const noexcept;
+
+    template<typename U> friend class AtomicCOW;
+    template<typename, typename, typename> friend class cow::borrowed;
+    template<typename, typename, typename, typename, typename> friend class cow::intern_pool;
+    friend class cow::detail::Batch;
 
     friend class BasicTest_Count_Test;
     friend class BasicTest_DefaultConstructed_Test;
+    friend class BasicTest_ImmortalSharedNull_Test;
+    friend class BasicTest_SingleThreadPolicy_Test;
+    friend class BasicTest_AssignAndEmplace_Test;
+    friend class BasicTest_Freeze_Test;
+    friend class BasicTest_FromStatic_Test;
+    friend class BasicTest_Borrowed_Test;
+    friend struct COWInspector;// Gives the other test suites access to count().
     int count()const;
 };
 
+// Payloads stored in the handle, see cow::inline_storage.
+template<typename T, typename Policy, typename Alloc>
+class COW<T, Policy, Alloc, true> final
+{
+public:
+    COW() noexcept(noexcept(T()));
+
+    template<typename Arg0, typename... Args, typename = typename std::enable_if<
+        !std::is_same<typename std::decay<Arg0>::type, COW>::value &&
+        !std::is_same<typename std::decay<Arg0>::type, std::allocator_arg_t>::value>::type>
+    explicit COW(Arg0&& arg0, Args&& ... args);// Forwarding constructor
+
+    template<typename... Args>
+    COW(std::allocator_arg_t, const Alloc& allocator, Args&& ... args);
+
+    typedef typename std::conditional<cow::deferred_detach<T>::value, const T*, T*>::type Arrow;
+
+          Arrow operator->()noexcept;
+    const T* operator->()const noexcept;
+
+          T& data()noexcept;
+    const T& constData()const noexcept;
+
+    template<typename M, typename U = T>
+    cow::field_proxy<COW, U, M> field(M U::* member) noexcept;
+
+    void swap(COW&& other);
+    void detach()noexcept;
+
+    void freeze()noexcept;// Nothing to do, inline payloads are never counted.
+    bool frozen()const noexcept;
+
+    static COW fromStatic(const cow::static_payload<T, Policy, Alloc>& payload);
+
+    T take()&&;// Leaves the payload moved from.
+
+    template<typename F>
+    T& detach_with(F transform);
+
+    cow::edit_guard<T, Policy> edit()noexcept;
+
+    T& assign(const T& value);
+    T& assign(T&& value);
+    template<typename... Args>
+    T& emplace(Args&&... args);
+
+    Alloc get_allocator()const noexcept;
+
+private:
+    T value;
+};
+
 
 
 //////////////////////////////////////////////////////////////////////////////
 //                    Implementation details follow:                        //
 //////////////////////////////////////////////////////////////////////////////
 
-template<typename T>
-inline T* COW<T>::operator->()
+template<typename T, typename Policy, typename Alloc, bool Inline>
+inline typename COW<T, Policy, Alloc, Inline>::Arrow COW<T, Policy, Alloc, Inline>::operator->()
+{
+    return arrow(cow::deferred_detach<T>());
+}
+
+template<typename T, typename Policy, typename Alloc, bool Inline>
+inline T* COW<T, Policy, Alloc, Inline>::arrow(std::false_type)
 {
     return &data();
 }
 
-template<typename T>
-inline const T* COW<T>::operator->()const noexcept
+template<typename T, typename Policy, typename Alloc, bool Inline>
+inline const T* COW<T, Policy, Alloc, Inline>::arrow(std::true_type)const noexcept
 {
     return &constData();
 }
 
-template<typename T>
-inline int COW<T>::count()const
+template<typename T, typename Policy, typename Alloc, bool Inline>
+template<typename M, typename U>
+inline cow::field_proxy<COW<T, Policy, Alloc, Inline>, U, M> COW<T, Policy, Alloc, Inline>::field(M U::* member) noexcept
+{
+    return cow::field_proxy<COW, U, M>(*this, member);
+}
+
+template<typename T, typename Policy, typename Alloc, bool Inline>
+inline const T* COW<T, Policy, Alloc, Inline>::operator->()const noexcept
+{
+    return &constData();
+}
+
+template<typename T, typename Policy, typename Alloc, bool Inline>
+inline int COW<T, Policy, Alloc, Inline>::count()const
 {
     // This function should only ever be accessed through the unit tests.
-    return (int)pointer.use_count();
+    return Policy::load(pointer->count);
 }
 
-template<typename T>
-inline void COW<T>::swap(COW&& other)noexcept
+template<typename T, typename Policy, typename Alloc, bool Inline>
+inline void COW<T, Policy, Alloc, Inline>::swap(COW&& other)noexcept
 {
-    pointer.swap(other);
+    std::swap(pointer, other.pointer);
 }
 
-template<typename T>
-inline T& COW<T>::data()
+template<typename T, typename Policy, typename Alloc, bool Inline>
+inline Alloc COW<T, Policy, Alloc, Inline>::get_allocator()const noexcept
+{
+    return Alloc(static_cast<const Block*>(pointer)->allocator());
+}
+
+template<typename T, typename Policy, typename Alloc, bool Inline>
+inline T& COW<T, Policy, Alloc, Inline>::data()
 {
     detach();
-    return *pointer;
+    return static_cast<Block*>(pointer)->value;
 }
 
-template<typename T>
-inline const T& COW<T>::constData()const noexcept
+template<typename T, typename Policy, typename Alloc, bool Inline>
+inline const T& COW<T, Policy, Alloc, Inline>::constData()const noexcept
 {
-    return *pointer;
+    return static_cast<const Block*>(pointer)->value;
 }
 
-template<typename T>
-inline void COW<T>::detach()
+template<typename T, typename Policy, typename Alloc, bool Inline>
+inline void COW<T, Policy, Alloc, Inline>::detach()
 {
-    if (!pointer.unique())
-        pointer = std::make_shared<T>(*pointer);
+    if (!cow::detail::unique(pointer))
+    {
+        Header* copy = Block::create(static_cast<Block*>(pointer)->allocator(),
+            cow::detail::Clone<T>::copy(constData()));
+        cow::detail::release(pointer);
+        pointer = copy;
+    }
+    else
+    {
+        cow::detail::assertNotBorrowed(pointer);
+    }
 }
 
-template<typename T>
-template<typename Arg0, typename... Args>
-inline COW<T>::COW(Arg0&& arg0, Args&&... args)
-    : pointer(std::make_shared<T>(std::forward<Arg0>(arg0), std::forward<Args>(args)...))
+template<typename T, typename Policy, typename Alloc, bool Inline>
+inline void COW<T, Policy, Alloc, Inline>::freeze()
 {
+    if (pointer->immortal())
+        return;
+    detach();
+    // This drops the last reference, so the count ends up at zero like that
+    // of any immortal block. No other handle can see the block yet.
+    Policy::decrement(pointer->count);
+    pointer->destroy = nullptr;
 }
 
-template<typename T>
-inline COW<T>::COW() noexcept(noexcept(T()))
+template<typename T, typename Policy, typename Alloc, bool Inline>
+inline bool COW<T, Policy, Alloc, Inline>::frozen()const noexcept
+{
+    return pointer->immortal();
+}
+
+template<typename T, typename Policy, typename Alloc, bool Inline>
+inline T COW<T, Policy, Alloc, Inline>::take()&&
+{
+    // old releases the payload after it has been moved or copied out.
+    const COW old(pointer, cow::detail::Adopt());
+    pointer = sharedNull();
+    if (cow::detail::unique(old.pointer))
+    {
+        cow::detail::assertNotBorrowed(old.pointer);
+        return std::move(static_cast<Block*>(old.pointer)->value);
+    }
+    return old.constData();
+}
+
+template<typename T, typename Policy, typename Alloc, bool Inline>
+template<typename F>
+inline T& COW<T, Policy, Alloc, Inline>::detach_with(F transform)
+{
+    Block* block = static_cast<Block*>(pointer);
+    if (cow::detail::unique(pointer))
+    {
+        cow::detail::assertNotBorrowed(pointer);
+        block->value = transform(constData());
+        return block->value;
+    }
+    Block* result = Block::create(block->allocator(), transform(constData()));
+    cow::detail::release(pointer);
+    pointer = result;
+    return result->value;
+}
+
+template<typename T, typename Policy, typename Alloc, bool Inline>
+inline cow::edit_guard<T, Policy> COW<T, Policy, Alloc, Inline>::edit()
+{
+    detach();
+    return cow::edit_guard<T, Policy>(static_cast<Block*>(pointer)->value, pointer);
+}
+
+template<typename T, typename Policy, typename Alloc, bool Inline>
+inline T& COW<T, Policy, Alloc, Inline>::assign(const T& value)
+{
+    Block* block = static_cast<Block*>(pointer);
+    if (cow::detail::unique(pointer))
+    {
+        cow::detail::assertNotBorrowed(pointer);
+        block->value = value;
+        return block->value;
+    }
+    Block* result = Block::create(block->allocator(), value);
+    cow::detail::release(pointer);
+    pointer = result;
+    return result->value;
+}
+
+template<typename T, typename Policy, typename Alloc, bool Inline>
+inline T& COW<T, Policy, Alloc, Inline>::assign(T&& value)
+{
+    Block* block = static_cast<Block*>(pointer);
+    if (cow::detail::unique(pointer))
+    {
+        cow::detail::assertNotBorrowed(pointer);
+        block->value = std::move(value);
+        return block->value;
+    }
+    Block* result = Block::create(block->allocator(), std::move(value));
+    cow::detail::release(pointer);
+    pointer = result;
+    return result->value;
+}
+
+template<typename T, typename Policy, typename Alloc, bool Inline>
+template<typename... Args>
+inline T& COW<T, Policy, Alloc, Inline>::emplace(Args&&... args)
+{
+    Block* block = static_cast<Block*>(pointer);
+    // The old value is only destroyed once nothing can throw any more, as
+    // the block can't be left without one. A constructor that may throw
+    // builds a temporary first, which is then moved into place.
+    if (std::is_nothrow_constructible<T, Args&&...>::value && cow::detail::unique(pointer))
+    {
+        cow::detail::assertNotBorrowed(pointer);
+        block->value.~T();
+        ::new(static_cast<void*>(&block->value)) T(std::forward<Args>(args)...);
+        return block->value;
+    }
+    if (std::is_nothrow_move_constructible<T>::value && cow::detail::unique(pointer))
+    {
+        cow::detail::assertNotBorrowed(pointer);
+        T value(std::forward<Args>(args)...);
+        block->value.~T();
+        ::new(static_cast<void*>(&block->value)) T(std::move(value));
+        return block->value;
+    }
+    Block* result = Block::create(block->allocator(), std::forward<Args>(args)...);
+    cow::detail::release(pointer);
+    pointer = result;
+    return result->value;
+}
+
+template<typename T, typename Policy, typename Alloc, bool Inline>
+template<typename Arg0, typename... Args, typename>
+inline COW<T, Policy, Alloc, Inline>::COW(Arg0&& arg0, Args&&... args)
+    : pointer(Block::create(typename Block::Allocator(), std::forward<Arg0>(arg0), std::forward<Args>(args)...))
+{
+}
+
+template<typename T, typename Policy, typename Alloc, bool Inline>
+template<typename... Args>
+inline COW<T, Policy, Alloc, Inline>::COW(std::allocator_arg_t, const Alloc& allocator, Args&&... args)
+    : pointer(Block::create(typename Block::Allocator(allocator), std::forward<Args>(args)...))
+{
+}
+
+template<typename T, typename Policy, typename Alloc, bool Inline>
+inline constexpr COW<T, Policy, Alloc, Inline>::COW() noexcept(noexcept(T()))
     : pointer(sharedNull())
 {
+    // No retain(): the shared null is immortal.
 }
 
-template<typename T>
-const std::shared_ptr<T>& COW<T>::sharedNull()noexcept(noexcept(T()))
+template<typename T, typename Policy, typename Alloc, bool Inline>
+inline COW<T, Policy, Alloc, Inline>::COW(Header* pointer, cow::detail::Adopt) noexcept
+    : pointer(pointer)
+{
+}
+
+template<typename T, typename Policy, typename Alloc, bool Inline>
+inline COW<T, Policy, Alloc, Inline>::COW(const COW& other) noexcept
+    : pointer(other.pointer)
+{
+    cow::detail::retain(pointer);
+}
+
+template<typename T, typename Policy, typename Alloc, bool Inline>
+inline COW<T, Policy, Alloc, Inline>::COW(COW&& other) noexcept
+    : pointer(other.pointer)
+{
+    other.pointer = nullptr;
+}
+
+template<typename T, typename Policy, typename Alloc, bool Inline>
+inline COW<T, Policy, Alloc, Inline>& COW<T, Policy, Alloc, Inline>::operator=(const COW& other) noexcept
+{
+    // Retain first, so that self assignment is harmless.
+    cow::detail::retain(other.pointer);
+    cow::detail::release(pointer);
+    pointer = other.pointer;
+    return *this;
+}
+
+template<typename T, typename Policy, typename Alloc, bool Inline>
+inline COW<T, Policy, Alloc, Inline>& COW<T, Policy, Alloc, Inline>::operator=(COW&& other) noexcept
+{
+    // Our old block is released when other goes out of scope.
+    std::swap(pointer, other.pointer);
+    return *this;
+}
+
+template<typename T, typename Policy, typename Alloc, bool Inline>
+inline COW<T, Policy, Alloc, Inline>::~COW()
+{
+    cow::detail::release(pointer);
+}
+
+template<typename T, typename Policy, typename Alloc, bool Inline>
+inline constexpr typename COW<T, Policy, Alloc, Inline>::Header* COW<T, Policy, Alloc, Inline>::sharedNull()noexcept(noexcept(T()))
+{
+    return cow::detail::SharedNull<Block>::get();
+}
+
+template<typename T, typename Policy, typename Alloc, bool Inline>
+inline COW<T, Policy, Alloc, Inline> COW<T, Policy, Alloc, Inline>::fromStatic(const cow::static_payload<T, Policy, Alloc>& payload) noexcept
+{
+    // Immortal, so there is no reference to adopt. It is never written to.
+    return COW(static_cast<Header*>(const_cast<Block*>(&payload.block)), cow::detail::Adopt());
+}
+
+template<typename T, typename Policy, typename Alloc, bool Inline>
+inline cow::borrowed<T, Policy, Alloc> COW<T, Policy, Alloc, Inline>::borrow()const noexcept
+{
+    return cow::borrowed<T, Policy, Alloc>(pointer);
+}
+
+template<typename T, typename Policy, typename Alloc>
+inline cow::borrowed<T, Policy, Alloc>::borrowed(Header* header) noexcept
+    : header(header)
+{
+    track(1);
+}
+
+template<typename T, typename Policy, typename Alloc>
+inline cow::borrowed<T, Policy, Alloc>::borrowed(const borrowed& other) noexcept
+    : header(other.header)
+{
+    track(1);
+}
+
+template<typename T, typename Policy, typename Alloc>
+inline cow::borrowed<T, Policy, Alloc>& cow::borrowed<T, Policy, Alloc>::operator=(const borrowed& other) noexcept
+{
+    other.track(1);// Works for self assignment, like COW's.
+    track(-1);
+    header = other.header;
+    return *this;
+}
+
+template<typename T, typename Policy, typename Alloc>
+inline cow::borrowed<T, Policy, Alloc>::~borrowed()
+{
+    track(-1);
+}
+
+template<typename T, typename Policy, typename Alloc>
+inline const T* cow::borrowed<T, Policy, Alloc>::operator->()const noexcept
+{
+    return &get();
+}
+
+template<typename T, typename Policy, typename Alloc>
+inline const T& cow::borrowed<T, Policy, Alloc>::operator*()const noexcept
+{
+    return get();
+}
+
+template<typename T, typename Policy, typename Alloc>
+inline const T& cow::borrowed<T, Policy, Alloc>::get()const noexcept
 {
-    static std::shared_ptr<T> sharedNull{std::make_shared<T>()};
-    return sharedNull;
-}
\ No newline at end of file
+    return static_cast<const Block*>(header)->value;
+}
+
+template<typename T, typename Policy, typename Alloc>
+inline COW<T, Policy, Alloc, false> cow::borrowed<T, Policy, Alloc>::to_owned()const noexcept
+{
+    detail::retain(header);
+    return COW<T, Policy, Alloc, false>(header, detail::Adopt());
+}
+
+template<typename T, typename Policy, typename Alloc>
+inline void cow::borrowed<T, Policy, Alloc>::track(int borrows)const noexcept
+{
+#ifndef NDEBUG
+    // Immortal blocks may be in read-only memory, and can't be changed anyway.
+    if (!header->immortal())
+        header->borrows.fetch_add(borrows, std::memory_order_relaxed);
+#else
+    (void)borrows;
+#endif
+}
+
+// Inline storage:
+
+template<typename T, typename Policy, typename Alloc>
+inline COW<T, Policy, Alloc, true>::COW() noexcept(noexcept(T()))
+    : value()
+{
+}
+
+template<typename T, typename Policy, typename Alloc>
+template<typename Arg0, typename... Args, typename>
+inline COW<T, Policy, Alloc, true>::COW(Arg0&& arg0, Args&&... args)
+    : value(std::forward<Arg0>(arg0), std::forward<Args>(args)...)
+{
+}
+
+template<typename T, typename Policy, typename Alloc>
+template<typename... Args>
+inline COW<T, Policy, Alloc, true>::COW(std::allocator_arg_t, const Alloc&, Args&&... args)
+    : value(std::forward<Args>(args)...)
+{
+}
+
+template<typename T, typename Policy, typename Alloc>
+inline typename COW<T, Policy, Alloc, true>::Arrow COW<T, Policy, Alloc, true>::operator->()noexcept
+{
+    return &value;
+}
+
+template<typename T, typename Policy, typename Alloc>
+template<typename M, typename U>
+inline cow::field_proxy<COW<T, Policy, Alloc, true>, U, M> COW<T, Policy, Alloc, true>::field(M U::* member) noexcept
+{
+    return cow::field_proxy<COW, U, M>(*this, member);
+}
+
+template<typename T, typename Policy, typename Alloc>
+inline const T* COW<T, Policy, Alloc, true>::operator->()const noexcept
+{
+    return &value;
+}
+
+template<typename T, typename Policy, typename Alloc>
+inline T& COW<T, Policy, Alloc, true>::data()noexcept
+{
+    return value;
+}
+
+template<typename T, typename Policy, typename Alloc>
+inline const T& COW<T, Policy, Alloc, true>::constData()const noexcept
+{
+    return value;
+}
+
+template<typename T, typename Policy, typename Alloc>
+inline void COW<T, Policy, Alloc, true>::swap(COW&& other)
+{
+    using std::swap;
+    swap(value, other.value);
+}
+
+template<typename T, typename Policy, typename Alloc>
+inline void COW<T, Policy, Alloc, true>::detach()noexcept
+{
+    // Never shared.
+}
+
+template<typename T, typename Policy, typename Alloc>
+inline void COW<T, Policy, Alloc, true>::freeze()noexcept
+{
+}
+
+template<typename T, typename Policy, typename Alloc>
+inline bool COW<T, Policy, Alloc, true>::frozen()const noexcept
+{
+    return false;
+}
+
+template<typename T, typename Policy, typename Alloc>
+inline COW<T, Policy, Alloc, true> COW<T, Policy, Alloc, true>::fromStatic(const cow::static_payload<T, Policy, Alloc>& payload)
+{
+    return COW(payload.get());
+}
+
+template<typename T, typename Policy, typename Alloc>
+inline T COW<T, Policy, Alloc, true>::take()&&
+{
+    return std::move(value);
+}
+
+template<typename T, typename Policy, typename Alloc>
+template<typename F>
+inline T& COW<T, Policy, Alloc, true>::detach_with(F transform)
+{
+    value = transform(constData());
+    return value;
+}
+
+template<typename T, typename Policy, typename Alloc>
+inline cow::edit_guard<T, Policy> COW<T, Policy, Alloc, true>::edit()noexcept
+{
+    return cow::edit_guard<T, Policy>(value, nullptr);
+}
+
+template<typename T, typename Policy, typename Alloc>
+inline T& COW<T, Policy, Alloc, true>::assign(const T& other)
+{
+    value = other;
+    return value;
+}
+
+template<typename T, typename Policy, typename Alloc>
+inline T& COW<T, Policy, Alloc, true>::assign(T&& other)
+{
+    value = std::move(other);
+    return value;
+}
+
+template<typename T, typename Policy, typename Alloc>
+template<typename... Args>
+inline T& COW<T, Policy, Alloc, true>::emplace(Args&&... args)
+{
+    value = T(std::forward<Args>(args)...);
+    return value;
+}
+
+template<typename T, typename Policy, typename Alloc>
+inline Alloc COW<T, Policy, Alloc, true>::get_allocator()const noexcept
+{
+    return Alloc();
+}
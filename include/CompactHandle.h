@@ -0,0 +1,421 @@
+/*
+Copyright(c) 2016 Bjoern Piltz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files(the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+#include "COW.h"
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
+struct COWInspector;
+
+namespace cow {
+
+/**
+ * A COW handle that stores a 32 bit index instead of a pointer:
+ *
+ *   std::vector<cow::compact_handle<Style>> cells;// 4 bytes per cell
+ *
+ * The payloads of all compact_handle<T, Policy> live in one table per type,
+ * which grows in segments and reuses the slots of destroyed payloads. It
+ * holds up to 2^32 - 65 payloads at a time, and its memory is kept for the
+ * lifetime of the program.
+ *
+ * Copying shares the payload and writes detach, exactly as with COW<T,
+ * Policy>, with which it also shares the reference counting policies. It
+ * has no allocator, arena, inline storage or deferred_detach support, and
+ * following the index costs a few instructions more than a pointer. Taking
+ * a free slot and giving it back lock a per type mutex.
+ *
+ * A moved-from compact_handle may only be assigned to or destroyed.
+ */
+template<typename T, typename Policy = multi_thread>
+class compact_handle final
+{
+public:
+    compact_handle();
+
+    template<typename Arg0, typename... Args, typename = typename std::enable_if<
+        !std::is_same<typename std::decay<Arg0>::type, compact_handle>::value>::type>
+    explicit compact_handle(Arg0&& arg0, Args&& ... args);// Forwarding constructor
+
+    compact_handle(const compact_handle& other) noexcept;
+    compact_handle(compact_handle&& other) noexcept;
+    compact_handle& operator=(const compact_handle& other) noexcept;
+    compact_handle& operator=(compact_handle&& other) noexcept;
+    ~compact_handle();
+
+          T* operator->();
+    const T* operator->()const noexcept;
+
+          T& data();
+    const T& constData()const noexcept;
+
+    void swap(compact_handle&& other)noexcept;
+    void detach();
+
+    // The payload's slot in the table. Handles sharing a payload have the
+    // same index.
+    std::uint32_t index()const noexcept;
+
+    // The number of payloads in the table, not counting the one default
+    // constructed handles share.
+    static std::size_t live() noexcept;
+
+private:
+    typedef detail::BlockHeader<Policy> Header;
+
+    std::uint32_t slot;
+
+    // Takes over a reference the caller already counted.
+    compact_handle(std::uint32_t slot, detail::Adopt) noexcept;
+    Header* header()const noexcept;
+
+    friend struct ::COWInspector;// Gives the test suites access to count().
+    int count()const;
+};
+
+namespace detail {
+
+// The position of the highest set bit of a non-zero value.
+inline int highestBit(std::uint32_t value) noexcept
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return 31 - __builtin_clz(value);
+#elif defined(_MSC_VER)
+    unsigned long bit;
+    _BitScanReverse(&bit, value);
+    return int(bit);
+#else
+    int bit = 0;
+    while (value >>= 1)
+        ++bit;
+    return bit;
+#endif
+}
+
+// The payloads of compact_handle<T, Policy>. Segment k holds 64 << k slots,
+// so growing never moves a payload, and an index is found from its highest
+// bit. Free slots form a list through their first bytes.
+template<typename T, typename Policy>
+class PayloadTable final
+{
+public:
+    typedef BlockHeader<Policy> Header;
+
+    struct Entry final : Header
+    {
+        template<typename... Args>
+        Entry(std::uint32_t index, typename Header::Destroy destroy, Args&&... args)
+            : Header(destroy)
+            , index(index)
+            , value(std::forward<Args>(args)...)
+        {
+        }
+        std::uint32_t index;
+        T value;
+    };
+
+    static const std::uint32_t None = 0xffffffff;// Moved-from handles.
+
+    template<typename... Args>
+    static std::uint32_t create(Args&&... args);
+    static std::uint32_t sharedNull();
+
+    static Entry& entry(std::uint32_t index) noexcept;
+    static std::size_t live() noexcept;
+
+private:
+    enum { FirstBits = 6, Segments = 32 - FirstBits };
+    typedef typename std::aligned_storage<sizeof(Entry), alignof(Entry)>::type Slot;
+
+    struct State
+    {
+        std::atomic<Slot*> segments[Segments];
+        std::mutex mutex;
+        std::uint32_t free;// The first free slot, or None.
+        std::uint32_t size;// Slots used so far, free or not.
+        std::size_t live;
+    };
+
+    static State& state() noexcept;
+    static Slot* slot(std::uint32_t index) noexcept;
+    static std::uint32_t acquire();
+    static void recycle(std::uint32_t index) noexcept;
+    static void destroy(Header* header);
+};
+
+}// namespace detail
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//                    Implementation details follow:                        //
+//////////////////////////////////////////////////////////////////////////////
+
+template<typename T, typename Policy>
+inline compact_handle<T, Policy>::compact_handle()
+    : slot(detail::PayloadTable<T, Policy>::sharedNull())
+{
+}
+
+template<typename T, typename Policy>
+template<typename Arg0, typename... Args, typename>
+inline compact_handle<T, Policy>::compact_handle(Arg0&& arg0, Args&& ... args)
+    : slot(detail::PayloadTable<T, Policy>::create(std::forward<Arg0>(arg0), std::forward<Args>(args)...))
+{
+}
+
+template<typename T, typename Policy>
+inline compact_handle<T, Policy>::compact_handle(std::uint32_t slot, detail::Adopt) noexcept
+    : slot(slot)
+{
+}
+
+template<typename T, typename Policy>
+inline compact_handle<T, Policy>::compact_handle(const compact_handle& other) noexcept
+    : slot(other.slot)
+{
+    detail::retain(header());
+}
+
+template<typename T, typename Policy>
+inline compact_handle<T, Policy>::compact_handle(compact_handle&& other) noexcept
+    : slot(other.slot)
+{
+    other.slot = detail::PayloadTable<T, Policy>::None;
+}
+
+template<typename T, typename Policy>
+inline compact_handle<T, Policy>& compact_handle<T, Policy>::operator=(const compact_handle& other) noexcept
+{
+    compact_handle(other).swap(std::move(*this));
+    return *this;
+}
+
+template<typename T, typename Policy>
+inline compact_handle<T, Policy>& compact_handle<T, Policy>::operator=(compact_handle&& other) noexcept
+{
+    compact_handle(std::move(other)).swap(std::move(*this));
+    return *this;
+}
+
+template<typename T, typename Policy>
+inline compact_handle<T, Policy>::~compact_handle()
+{
+    detail::release(header());
+}
+
+template<typename T, typename Policy>
+inline T* compact_handle<T, Policy>::operator->()
+{
+    return &data();
+}
+
+template<typename T, typename Policy>
+inline const T* compact_handle<T, Policy>::operator->()const noexcept
+{
+    return &constData();
+}
+
+template<typename T, typename Policy>
+inline T& compact_handle<T, Policy>::data()
+{
+    detach();
+    return detail::PayloadTable<T, Policy>::entry(slot).value;
+}
+
+template<typename T, typename Policy>
+inline const T& compact_handle<T, Policy>::constData()const noexcept
+{
+    return detail::PayloadTable<T, Policy>::entry(slot).value;
+}
+
+template<typename T, typename Policy>
+inline void compact_handle<T, Policy>::swap(compact_handle&& other)noexcept
+{
+    std::swap(slot, other.slot);
+}
+
+template<typename T, typename Policy>
+inline void compact_handle<T, Policy>::detach()
+{
+    if (!detail::unique(header()))
+    {
+        compact_handle copy(detail::PayloadTable<T, Policy>::create(detail::Clone<T>::copy(constData())), detail::Adopt());
+        copy.swap(std::move(*this));
+    }
+}
+
+template<typename T, typename Policy>
+inline std::uint32_t compact_handle<T, Policy>::index()const noexcept
+{
+    return slot;
+}
+
+template<typename T, typename Policy>
+inline std::size_t compact_handle<T, Policy>::live() noexcept
+{
+    return detail::PayloadTable<T, Policy>::live();
+}
+
+template<typename T, typename Policy>
+inline typename compact_handle<T, Policy>::Header* compact_handle<T, Policy>::header()const noexcept
+{
+    return slot == detail::PayloadTable<T, Policy>::None ? nullptr : &detail::PayloadTable<T, Policy>::entry(slot);
+}
+
+template<typename T, typename Policy>
+inline int compact_handle<T, Policy>::count()const
+{
+    return Policy::load(header()->count);
+}
+
+namespace detail {
+
+template<typename T, typename Policy>
+template<typename... Args>
+inline std::uint32_t PayloadTable<T, Policy>::create(Args&&... args)
+{
+    const std::uint32_t index = acquire();
+    try
+    {
+        ::new(slot(index)) Entry(index, &PayloadTable::destroy, std::forward<Args>(args)...);
+    }
+    catch (...)
+    {
+        recycle(index);
+        throw;
+    }
+    return index;
+}
+
+// Immortal like the shared null of COW, in a slot that is never recycled.
+template<typename T, typename Policy>
+inline std::uint32_t PayloadTable<T, Policy>::sharedNull()
+{
+    struct Init
+    {
+        static std::uint32_t make()
+        {
+            const std::uint32_t index = acquire();
+            try
+            {
+                ::new(slot(index)) Entry(index, nullptr);
+            }
+            catch (...)
+            {
+                recycle(index);
+                throw;
+            }
+            std::lock_guard<std::mutex> lock(state().mutex);
+            --state().live;// Not counted by live().
+            return index;
+        }
+    };
+    static const std::uint32_t index = Init::make();
+    return index;
+}
+
+template<typename T, typename Policy>
+inline typename PayloadTable<T, Policy>::Entry& PayloadTable<T, Policy>::entry(std::uint32_t index) noexcept
+{
+    return *reinterpret_cast<Entry*>(slot(index));
+}
+
+template<typename T, typename Policy>
+inline std::size_t PayloadTable<T, Policy>::live() noexcept
+{
+    std::lock_guard<std::mutex> lock(state().mutex);
+    return state().live;
+}
+
+template<typename T, typename Policy>
+inline typename PayloadTable<T, Policy>::State& PayloadTable<T, Policy>::state() noexcept
+{
+    // Never destroyed, so that handles in static objects outlive it.
+    static State* state = new State{{}, {}, None, 0, 0};
+    return *state;
+}
+
+template<typename T, typename Policy>
+inline typename PayloadTable<T, Policy>::Slot* PayloadTable<T, Policy>::slot(std::uint32_t index) noexcept
+{
+    // Handing a handle to another thread publishes its segment with it.
+    const std::uint32_t position = index + (1u << FirstBits);
+    const int bit = highestBit(position);
+    return state().segments[bit - FirstBits].load(std::memory_order_relaxed) + (position - (1u << bit));
+}
+
+template<typename T, typename Policy>
+inline std::uint32_t PayloadTable<T, Policy>::acquire()
+{
+    State& table = state();
+    std::lock_guard<std::mutex> lock(table.mutex);
+    std::uint32_t index = table.free;
+    if (index != None)
+    {
+        table.free = *reinterpret_cast<std::uint32_t*>(slot(index));
+    }
+    else
+    {
+        if (table.size == None - (1u << FirstBits))
+            throw std::bad_alloc();
+        index = table.size;
+        const int segment = highestBit(index + (1u << FirstBits)) - FirstBits;
+        if (!table.segments[segment].load(std::memory_order_relaxed))
+        {
+            void* memory = std::malloc(sizeof(Slot) << (segment + FirstBits));
+            if (!memory)
+                throw std::bad_alloc();
+            table.segments[segment].store(static_cast<Slot*>(memory), std::memory_order_release);
+        }
+        ++table.size;
+    }
+    ++table.live;
+    return index;
+}
+
+template<typename T, typename Policy>
+inline void PayloadTable<T, Policy>::recycle(std::uint32_t index) noexcept
+{
+    State& table = state();
+    std::lock_guard<std::mutex> lock(table.mutex);
+    ::new(slot(index)) std::uint32_t(table.free);
+    table.free = index;
+    --table.live;
+}
+
+template<typename T, typename Policy>
+inline void PayloadTable<T, Policy>::destroy(Header* header)
+{
+    Entry* entry = static_cast<Entry*>(header);
+    const std::uint32_t index = entry->index;
+    entry->~Entry();
+    recycle(index);
+}
+
+}// namespace detail
+}// namespace cow
@@ -0,0 +1,248 @@
+/*
+Copyright(c) 2016 Bjoern Piltz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files(the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace cow {
+
+/**
+ * Epoch based reclamation for read-side critical sections.
+ *
+ * While a thread holds an epoch_guard, nothing retired after the guard was
+ * created is destroyed, so readers can use plain references instead of
+ * counting. AtomicCOW::borrow() builds on this:
+ *
+ *   {
+ *       cow::epoch_guard guard;
+ *       const Table& table = cell.borrow(guard);
+ *       ...// table stays valid until guard goes out of scope.
+ *   }
+ *
+ * Entering and leaving a section writes only to the calling thread's own
+ * record, so it scales with the number of reader threads. Keep sections
+ * short: while one is open, nothing retired can be reclaimed.
+ *
+ * Guards nest. They must be destroyed on the thread that created them.
+ */
+class epoch_guard final
+{
+public:
+    epoch_guard() noexcept;
+    ~epoch_guard();
+
+    epoch_guard(const epoch_guard&) = delete;
+    epoch_guard& operator=(const epoch_guard&) = delete;
+};
+
+class epoch final
+{
+public:
+    // Calls release(object) once no thread can be in a section that
+    // started before this call.
+    static void retire(void* object, void (*release)(void*));
+
+    // Advances the epoch if possible and releases what became safe.
+    // Returns the number of objects released.
+    static int collect();
+
+private:
+    // One per thread, never freed but reused after their thread exited.
+    struct record
+    {
+        std::atomic<unsigned> state{0};// epoch << 1 | active
+        std::atomic<bool> used{true};
+        int nesting = 0;
+        record* next = nullptr;
+    };
+    struct retired
+    {
+        void* object;
+        void (*release)(void*);
+        unsigned epoch;
+    };
+
+    static void enter() noexcept;
+    static void leave() noexcept;
+    static record* current() noexcept;
+    static record* acquire();
+    static bool tryAdvance() noexcept;
+    static void releaseExpired(std::unique_lock<std::mutex>& lock);
+
+    static std::atomic<unsigned>& global() noexcept;
+    static std::atomic<record*>& records() noexcept;
+    static std::mutex& mutex() noexcept;
+    static std::vector<retired>& limbo() noexcept;
+
+    friend class epoch_guard;
+};
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//                    Implementation details follow:                        //
+//////////////////////////////////////////////////////////////////////////////
+
+inline epoch_guard::epoch_guard() noexcept
+{
+    epoch::enter();
+}
+
+inline epoch_guard::~epoch_guard()
+{
+    epoch::leave();
+}
+
+inline void epoch::enter() noexcept
+{
+    record* self = current();
+    if (self->nesting++ == 0)
+    {
+        // Announce the epoch we read in, before reading anything shared.
+        self->state.store(global().load(std::memory_order_relaxed) << 1 | 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+}
+
+inline void epoch::leave() noexcept
+{
+    record* self = current();
+    if (--self->nesting == 0)
+        self->state.store(0, std::memory_order_release);
+}
+
+inline epoch::record* epoch::current() noexcept
+{
+    // Hands the record back for reuse when the thread exits.
+    struct Owner
+    {
+        record* self = nullptr;
+        ~Owner()
+        {
+            if (self)
+                self->used.store(false, std::memory_order_release);
+        }
+    };
+    static thread_local Owner owner;
+    if (!owner.self)
+        owner.self = acquire();
+    return owner.self;
+}
+
+inline epoch::record* epoch::acquire()
+{
+    for (record* r = records().load(std::memory_order_acquire); r; r = r->next)
+    {
+        bool used = false;
+        if (!r->used.load(std::memory_order_relaxed) && r->used.compare_exchange_strong(used, true, std::memory_order_acquire))
+            return r;
+    }
+    record* r = new record;
+    r->next = records().load(std::memory_order_relaxed);
+    while (!records().compare_exchange_weak(r->next, r, std::memory_order_release, std::memory_order_relaxed))
+    {
+    }
+    return r;
+}
+
+inline void epoch::retire(void* object, void (*release)(void*))
+{
+    std::unique_lock<std::mutex> lock(mutex());
+    limbo().push_back(retired{object, release, global().load(std::memory_order_seq_cst)});
+    tryAdvance();
+    releaseExpired(lock);
+}
+
+inline int epoch::collect()
+{
+    std::unique_lock<std::mutex> lock(mutex());
+    const std::size_t before = limbo().size();
+    tryAdvance();
+    releaseExpired(lock);
+    return int(before - limbo().size());
+}
+
+// Succeeds if every thread in a section has seen the current epoch.
+inline bool epoch::tryAdvance() noexcept
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    unsigned current = global().load(std::memory_order_relaxed);
+    for (record* r = records().load(std::memory_order_acquire); r; r = r->next)
+    {
+        const unsigned state = r->state.load(std::memory_order_acquire);
+        if ((state & 1) && (state >> 1) != current)
+            return false;
+    }
+    return global().compare_exchange_strong(current, current + 1, std::memory_order_seq_cst);
+}
+
+// Objects retired in epoch e may still be seen by sections that started in
+// e; they are gone once the epoch advanced twice. Called with the mutex
+// held, which is released while the objects are released.
+inline void epoch::releaseExpired(std::unique_lock<std::mutex>& lock)
+{
+    const unsigned current = global().load(std::memory_order_relaxed);
+    std::vector<retired> expired;
+    std::vector<retired>& list = limbo();
+    for (std::size_t i = 0; i < list.size();)
+    {
+        if (current - list[i].epoch >= 2)
+        {
+            expired.push_back(list[i]);
+            list[i] = list.back();
+            list.pop_back();
+        }
+        else
+            ++i;
+    }
+    lock.unlock();
+    for (const retired& item : expired)
+        item.release(item.object);
+}
+
+inline std::atomic<unsigned>& epoch::global() noexcept
+{
+    static std::atomic<unsigned> value{0};
+    return value;
+}
+
+inline std::atomic<epoch::record*>& epoch::records() noexcept
+{
+    static std::atomic<record*> head{nullptr};
+    return head;
+}
+
+inline std::mutex& epoch::mutex() noexcept
+{
+    static std::mutex value;
+    return value;
+}
+
+inline std::vector<epoch::retired>& epoch::limbo() noexcept
+{
+    static std::vector<retired> list;
+    return list;
+}
+
+}// namespace cow
@@ -0,0 +1,207 @@
+/*
+Copyright(c) 2016 Bjoern Piltz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files(the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+#include "COW.h"
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+
+namespace cow {
+
+// What an intern_pool did so far.
+struct intern_stats
+{
+    std::size_t interned;    // Calls to intern().
+    std::size_t deduplicated;// Handles pointed at an equal payload.
+    std::size_t bytes_saved; // Blocks of duplicates freed by that, sizeof
+                             // header and payload each. What a payload
+                             // allocates itself is not included.
+
+    // The share of interned handles that had a duplicate.
+    double ratio()const noexcept
+    {
+        return interned ? double(deduplicated)/interned : 0.0;
+    }
+};
+
+/**
+ * Hash consing for COW payloads: handles to equal payloads are pointed at
+ * one of them, and the duplicates freed.
+ *
+ *   cow::intern_pool<Style> styles;
+ *   for (Cell& cell : cells)
+ *       styles.intern(cell.style);
+ *
+ * The pool holds a reference to each payload it knows. Interned payloads
+ * are therefore always shared, and the first write through any of their
+ * handles detaches, so a pooled payload never changes. Entries that no
+ * handle refers to any more are dropped by purge(), and by intern()
+ * whenever the pool has doubled in size since it last looked, which keeps
+ * at most as many dropped payloads alive as there are live ones.
+ *
+ * Payloads in an arena_scope are rebound, but never pooled, since the pool
+ * may outlive the scope. The pool must not be given moved-from handles.
+ * All member functions may be called concurrently.
+ */
+template<typename T, typename Policy = multi_thread, typename Alloc = typename default_allocator<T>::type,
+    typename Hash = std::hash<T>, typename Equal = std::equal_to<T>>
+class intern_pool final
+{
+    static_assert(!inline_storage<T>::value, "inline payloads are never shared");
+
+public:
+    typedef COW<T, Policy, Alloc> handle_type;
+
+    explicit intern_pool(const Hash& hash = Hash(), const Equal& equal = Equal());
+
+    intern_pool(const intern_pool&) = delete;
+    intern_pool& operator=(const intern_pool&) = delete;
+
+    // Points handle at the pooled payload equal to its own and returns true
+    // if there is one. Adds its payload to the pool otherwise.
+    bool intern(handle_type& handle);
+
+    // Drops the payloads no handle refers to, and returns how many.
+    std::size_t purge();
+
+    // The number of pooled payloads, including ones not purged yet.
+    std::size_t size()const;
+
+    intern_stats stats()const;
+
+private:
+    typedef detail::BlockHeader<Policy> Header;
+    typedef detail::Block<T, Policy, Alloc> Block;
+    typedef std::unordered_multimap<std::size_t, handle_type> Entries;
+
+    std::size_t purgeLocked() noexcept;
+    static bool unreferenced(const handle_type& entry) noexcept;
+
+    Hash hash;
+    Equal equal;
+    mutable std::mutex mutex;
+    Entries entries;
+    std::size_t nextPurge;
+    intern_stats counters;
+};
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//                    Implementation details follow:                        //
+//////////////////////////////////////////////////////////////////////////////
+
+template<typename T, typename Policy, typename Alloc, typename Hash, typename Equal>
+inline intern_pool<T, Policy, Alloc, Hash, Equal>::intern_pool(const Hash& hash, const Equal& equal)
+    : hash(hash)
+    , equal(equal)
+    , nextPurge(64)
+    , counters{0, 0, 0}
+{
+}
+
+template<typename T, typename Policy, typename Alloc, typename Hash, typename Equal>
+inline bool intern_pool<T, Policy, Alloc, Hash, Equal>::intern(handle_type& handle)
+{
+    const std::size_t key = hash(handle.constData());
+
+    std::unique_lock<std::mutex> lock(mutex);
+    ++counters.interned;
+
+    const auto range = entries.equal_range(key);
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        if (it->second.pointer == handle.pointer)
+            return false;
+        if (equal(it->second.constData(), handle.constData()))
+        {
+            if (!handle.pointer->immortal() && detail::unique(handle.pointer))
+                counters.bytes_saved += sizeof(Block);
+            ++counters.deduplicated;
+            handle_type duplicate(std::move(handle));
+            handle = it->second;
+            // The duplicate's destructor doesn't need to run under the mutex.
+            lock.unlock();
+            return true;
+        }
+    }
+
+    if (Block::scoped(handle.pointer))
+        return false;
+    if (entries.size() >= nextPurge)
+    {
+        purgeLocked();
+        nextPurge = 2*entries.size() > 64 ? 2*entries.size() : 64;
+    }
+    entries.emplace(key, handle);
+    return false;
+}
+
+template<typename T, typename Policy, typename Alloc, typename Hash, typename Equal>
+inline std::size_t intern_pool<T, Policy, Alloc, Hash, Equal>::purge()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return purgeLocked();
+}
+
+template<typename T, typename Policy, typename Alloc, typename Hash, typename Equal>
+inline std::size_t intern_pool<T, Policy, Alloc, Hash, Equal>::purgeLocked() noexcept
+{
+    std::size_t dropped = 0;
+    for (auto it = entries.begin(); it != entries.end();)
+    {
+        if (unreferenced(it->second))
+        {
+            it = entries.erase(it);
+            ++dropped;
+        }
+        else
+        {
+            ++it;
+        }
+    }
+    return dropped;
+}
+
+// Only the pool refers to the payload, so nothing else can start to.
+template<typename T, typename Policy, typename Alloc, typename Hash, typename Equal>
+inline bool intern_pool<T, Policy, Alloc, Hash, Equal>::unreferenced(const handle_type& entry) noexcept
+{
+    return !entry.pointer->immortal() && detail::unique(entry.pointer);
+}
+
+template<typename T, typename Policy, typename Alloc, typename Hash, typename Equal>
+inline std::size_t intern_pool<T, Policy, Alloc, Hash, Equal>::size()const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return entries.size();
+}
+
+template<typename T, typename Policy, typename Alloc, typename Hash, typename Equal>
+inline intern_stats intern_pool<T, Policy, Alloc, Hash, Equal>::stats()const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
+
+}// namespace cow
@@ -0,0 +1,185 @@
+/*
+Copyright(c) 2016 Bjoern Piltz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files(the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+#include "COW.h"
+#include <cstdint>
+
+namespace cow {
+
+/**
+ * Sharded reference counting: COW<T, cow::sharded<Slots>>.
+ *
+ * The count of a payload is spread over Slots padded slots, and every
+ * thread copies and releases handles in a slot of its own. A thread that
+ * holds on to one handle and copies it around only ever writes its own
+ * slot's cache line, however many threads share the payload. This suits
+ * fan-out workloads where the single atomic counter of cow::multi_thread
+ * limits throughput. Each payload's block grows by Slots cache lines, so
+ * reserve it for the few payloads that are really contended.
+ *
+ * A release that empties its thread's slot, or finds it empty because the
+ * handle was copied on another thread, takes a unit from another slot and
+ * then checks whether all of them are empty. It reads the slots until two
+ * passes in a row match, so the sum it sees held at one instant and the
+ * last release is detected exactly. detach() reads the slots the same way.
+ */
+template<unsigned Slots = 16>
+struct sharded
+{
+    static_assert(Slots > 0, "at least one slot is needed");
+
+    struct counter
+    {
+        explicit counter(int initial) noexcept;
+
+        // Every slot holds a count in its low half and the number of
+        // changes in its high half, which tells readers it changed. Slots
+        // are padded to a cache line each, but not aligned to one, so that
+        // blocks keep the alignment operator new guarantees.
+        struct slot
+        {
+            std::atomic<std::uint64_t> word;
+            char padding[64 - sizeof(std::atomic<std::uint64_t>)];
+        };
+        slot slots[Slots];
+        std::atomic<int> releasing;// Releases on the slow path.
+        std::atomic<bool> zero;    // All slots were seen empty.
+    };
+
+    static void increment(counter& count) noexcept;
+    static bool decrement(counter& count) noexcept;
+    static int load(const counter& count) noexcept;
+
+private:
+    static const std::uint64_t Change = std::uint64_t(1) << 32;
+    static const std::uint64_t Count = Change - 1;
+
+    static unsigned mine() noexcept;
+    static bool take(std::atomic<std::uint64_t>& slot) noexcept;
+    static std::uint64_t sum(const counter& count) noexcept;
+};
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//                    Implementation details follow:                        //
+//////////////////////////////////////////////////////////////////////////////
+
+template<unsigned Slots>
+inline sharded<Slots>::counter::counter(int initial) noexcept
+    : releasing(0)
+    , zero(false)
+{
+    for (slot& s : slots)
+        s.word.store(0, std::memory_order_relaxed);
+    if (initial)
+        slots[mine()].word.store(std::uint64_t(initial), std::memory_order_relaxed);
+}
+
+template<unsigned Slots>
+inline void sharded<Slots>::increment(counter& count) noexcept
+{
+    count.slots[mine()].word.fetch_add(Change + 1, std::memory_order_relaxed);
+}
+
+template<unsigned Slots>
+inline bool sharded<Slots>::decrement(counter& count) noexcept
+{
+    std::atomic<std::uint64_t>& own = count.slots[mine()].word;
+    std::uint64_t word = own.load(std::memory_order_relaxed);
+    while ((word & Count) > 1)
+    {
+        // The slot keeps a unit, so some handle is still alive.
+        if (own.compare_exchange_weak(word, word + Change - 1, std::memory_order_release, std::memory_order_relaxed))
+            return false;
+    }
+
+    // Take the unit from wherever one is left. The caller's handle is
+    // counted somewhere, so this ends.
+    count.releasing.fetch_add(1, std::memory_order_acq_rel);
+    if (!take(own))
+    {
+        for (unsigned i = 0; !take(count.slots[i].word); i = (i + 1) % Slots)
+        {
+        }
+    }
+    // Nothing counts up from zero, but several releases may see it. The
+    // last one to leave frees the payload, when no other one can touch it.
+    if (sum(count) == 0)
+        count.zero.store(true, std::memory_order_relaxed);
+    return count.releasing.fetch_sub(1, std::memory_order_acq_rel) == 1
+        && count.zero.load(std::memory_order_relaxed);
+}
+
+template<unsigned Slots>
+inline int sharded<Slots>::load(const counter& count) noexcept
+{
+    return int(sum(count));
+}
+
+template<unsigned Slots>
+inline unsigned sharded<Slots>::mine() noexcept
+{
+    static std::atomic<unsigned> threads(0);
+    static thread_local const unsigned index = threads.fetch_add(1, std::memory_order_relaxed) % Slots;
+    return index;
+}
+
+// Takes a unit from the slot, unless it is empty.
+template<unsigned Slots>
+inline bool sharded<Slots>::take(std::atomic<std::uint64_t>& slot) noexcept
+{
+    std::uint64_t word = slot.load(std::memory_order_relaxed);
+    while (word & Count)
+    {
+        if (slot.compare_exchange_weak(word, word + Change - 1, std::memory_order_acq_rel, std::memory_order_relaxed))
+            return true;
+    }
+    return false;
+}
+
+// The sum of all slots at one instant: collects them until two
+// collections in a row match.
+template<unsigned Slots>
+inline std::uint64_t sharded<Slots>::sum(const counter& count) noexcept
+{
+    std::uint64_t words[Slots];
+    for (unsigned i = 0; i < Slots; ++i)
+        words[i] = count.slots[i].word.load(std::memory_order_acquire);
+    for (;;)
+    {
+        bool same = true;
+        std::uint64_t total = 0;
+        for (unsigned i = 0; i < Slots; ++i)
+        {
+            const std::uint64_t word = count.slots[i].word.load(std::memory_order_acquire);
+            same = same && word == words[i];
+            words[i] = word;
+            total += word & Count;
+        }
+        if (same)
+            return total;
+    }
+}
+
+}// namespace cow
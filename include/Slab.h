@@ -0,0 +1,369 @@
+/*
+Copyright(c) 2016 Bjoern Piltz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files(the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+#include "COW.h"
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace cow {
+
+/**
+ * A thread caching slab allocator for COW payload blocks, enabled per
+ * payload type with cow::slab_allocated (see COW.h), or used explicitly as
+ * COW<T, Policy, cow::slab_allocator<T>>.
+ *
+ * Every block type has its own pool of fixed size slots, carved from slabs
+ * of SlabSlots slots. Each thread keeps a free list per pool, so most
+ * allocations and deallocations touch no shared state. Threads exchange
+ * slots with the pool in batches, and hand their cache back when they
+ * exit. Blocks released on a thread after that, e.g. by statics at program
+ * exit, go straight to the pool. Slabs are kept for the lifetime of the
+ * process.
+ */
+struct slab_stats
+{
+    std::size_t slot_size;// Bytes per block, counter and payload included.
+    std::size_t slabs;
+    std::size_t capacity; // Slots in all slabs.
+    std::size_t in_use;   // Slots holding a live block.
+
+    double occupancy()const noexcept
+    {
+        return capacity ? double(in_use)/double(capacity) : 0.0;
+    }
+};
+
+template<typename T>
+class slab_allocator
+{
+public:
+    typedef T value_type;
+
+    slab_allocator() noexcept = default;
+    template<typename U>
+    slab_allocator(const slab_allocator<U>&) noexcept {}
+
+    T* allocate(std::size_t n);
+    void deallocate(T* p, std::size_t n) noexcept;
+
+    // Statistics of the pool for T.
+    static slab_stats statistics();
+};
+
+template<typename T, typename U>
+inline bool operator==(const slab_allocator<T>&, const slab_allocator<U>&) noexcept { return true; }
+template<typename T, typename U>
+inline bool operator!=(const slab_allocator<T>&, const slab_allocator<U>&) noexcept { return false; }
+
+// Statistics of the slab pool that holds the payloads of COW<T, Policy>.
+template<typename T, typename Policy = multi_thread>
+slab_stats slab_statistics();
+
+namespace detail {
+
+template<typename T>
+class SlabPool final
+{
+public:
+    static const std::size_t Align = alignof(T) > alignof(void*) ? alignof(T) : alignof(void*);
+    static const std::size_t SlotSize = ((sizeof(T) > sizeof(void*) ? sizeof(T) : sizeof(void*)) + Align - 1)/Align*Align;
+    static const std::size_t SlabSlots = 4096/SlotSize > 16 ? 4096/SlotSize : 16;
+    static const std::size_t Batch = 32;
+
+    static void* allocate();
+    static void deallocate(void* slot) noexcept;
+    static slab_stats statistics();
+
+private:
+    struct Slot
+    {
+        Slot* next;
+    };
+
+    // A thread's free list, plus what it allocated and freed. Counters are
+    // only written by their thread and read by statistics().
+    struct Cache
+    {
+        Cache();
+        ~Cache();
+
+        Slot* free;
+        std::size_t size;
+        std::atomic<std::size_t> allocated;
+        std::atomic<std::size_t> freed;
+    };
+
+    SlabPool() = default;
+    static SlabPool& instance();
+    static Cache* cache();// Null once the thread's cache is destroyed.
+    static Cache*& current() noexcept;
+    static bool& exited() noexcept;
+    void* allocateShared();
+    void deallocateShared(Slot* slot) noexcept;
+    void refill(Cache& cache);
+    void carve();
+    void drain(Cache& cache, std::size_t keep) noexcept;
+
+    std::mutex mutex;// Guards everything below.
+    Slot* free = nullptr;
+    std::size_t slabs = 0;
+    std::size_t allocated = 0;// By threads that exited.
+    std::size_t freed = 0;
+    std::vector<Cache*> caches;
+};
+
+}// namespace detail
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//                    Implementation details follow:                        //
+//////////////////////////////////////////////////////////////////////////////
+
+template<typename T>
+inline T* slab_allocator<T>::allocate(std::size_t n)
+{
+    static_assert(alignof(T) <= alignof(std::max_align_t), "over aligned types are not supported");
+    if (n != 1)
+        return static_cast<T*>(::operator new(n*sizeof(T)));
+    return static_cast<T*>(detail::SlabPool<T>::allocate());
+}
+
+template<typename T>
+inline void slab_allocator<T>::deallocate(T* p, std::size_t n) noexcept
+{
+    if (n != 1)
+        ::operator delete(p);
+    else
+        detail::SlabPool<T>::deallocate(p);
+}
+
+template<typename T>
+inline slab_stats slab_allocator<T>::statistics()
+{
+    return detail::SlabPool<T>::statistics();
+}
+
+template<typename T, typename Policy>
+inline slab_stats slab_statistics()
+{
+    return slab_allocator<detail::Block<T, Policy, slab_allocator<T>>>::statistics();
+}
+
+namespace detail {
+
+template<typename T>
+inline void* SlabPool<T>::allocate()
+{
+    Cache* cached = cache();
+    if (!cached)
+        return instance().allocateShared();
+    Cache& local = *cached;
+    if (!local.free)
+        instance().refill(local);
+    Slot* slot = local.free;
+    local.free = slot->next;
+    --local.size;
+    local.allocated.store(local.allocated.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    return slot;
+}
+
+template<typename T>
+inline void SlabPool<T>::deallocate(void* p) noexcept
+{
+    Slot* slot = static_cast<Slot*>(p);
+    Cache* cached = cache();
+    if (!cached)
+        return instance().deallocateShared(slot);
+    Cache& local = *cached;
+    slot->next = local.free;
+    local.free = slot;
+    ++local.size;
+    local.freed.store(local.freed.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    if (local.size > 2*Batch)
+        instance().drain(local, Batch);
+}
+
+template<typename T>
+inline slab_stats SlabPool<T>::statistics()
+{
+    SlabPool& pool = instance();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    std::size_t allocated = pool.allocated, freed = pool.freed;
+    for (const Cache* cache : pool.caches)
+    {
+        // Read freed first, so that a concurrent pair can't make in_use negative.
+        freed += cache->freed.load(std::memory_order_relaxed);
+        allocated += cache->allocated.load(std::memory_order_relaxed);
+    }
+    slab_stats stats;
+    stats.slot_size = SlotSize;
+    stats.slabs = pool.slabs;
+    stats.capacity = pool.slabs*SlabSlots;
+    stats.in_use = allocated > freed ? allocated - freed : 0;
+    return stats;
+}
+
+template<typename T>
+inline SlabPool<T>& SlabPool<T>::instance()
+{
+    // Never destroyed: payloads in static storage may be released late.
+    static SlabPool* pool = new SlabPool;
+    return *pool;
+}
+
+template<typename T>
+inline typename SlabPool<T>::Cache* SlabPool<T>::cache()
+{
+    // The cache must not be touched once it is destroyed, which happens
+    // before other thread_local and static objects of the thread may
+    // release their payloads. The flags are trivially destructible, so
+    // they stay valid until the thread is gone.
+    Cache*& local = current();
+    if (!local && !exited())
+    {
+        static thread_local Cache cache;
+        local = &cache;
+    }
+    return local;
+}
+
+template<typename T>
+inline typename SlabPool<T>::Cache*& SlabPool<T>::current() noexcept
+{
+    static thread_local Cache* cache = nullptr;
+    return cache;
+}
+
+template<typename T>
+inline bool& SlabPool<T>::exited() noexcept
+{
+    static thread_local bool exited = false;
+    return exited;
+}
+
+// Used by threads whose cache is gone.
+template<typename T>
+inline void* SlabPool<T>::allocateShared()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!free)
+        carve();
+    Slot* slot = free;
+    free = slot->next;
+    ++allocated;
+    return slot;
+}
+
+template<typename T>
+inline void SlabPool<T>::deallocateShared(Slot* slot) noexcept
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    slot->next = free;
+    free = slot;
+    ++freed;
+}
+
+template<typename T>
+inline SlabPool<T>::Cache::Cache()
+    : free(nullptr)
+    , size(0)
+    , allocated(0)
+    , freed(0)
+{
+    SlabPool& pool = instance();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    pool.caches.push_back(this);
+}
+
+template<typename T>
+inline SlabPool<T>::Cache::~Cache()
+{
+    current() = nullptr;
+    exited() = true;
+    SlabPool& pool = instance();
+    pool.drain(*this, 0);
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    pool.allocated += allocated.load(std::memory_order_relaxed);
+    pool.freed += freed.load(std::memory_order_relaxed);
+    for (std::size_t i = 0; i < pool.caches.size(); ++i)
+    {
+        if (pool.caches[i] == this)
+        {
+            pool.caches[i] = pool.caches.back();
+            pool.caches.pop_back();
+            break;
+        }
+    }
+}
+
+// Moves a batch of slots to the thread, carving a new slab if needed.
+template<typename T>
+inline void SlabPool<T>::refill(Cache& local)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!free)
+        carve();
+    for (std::size_t i = 0; i < Batch && free; ++i)
+    {
+        Slot* slot = free;
+        free = slot->next;
+        slot->next = local.free;
+        local.free = slot;
+        ++local.size;
+    }
+}
+
+// Adds a new slab to the empty free list. Called with the mutex held.
+template<typename T>
+inline void SlabPool<T>::carve()
+{
+    char* slab = static_cast<char*>(::operator new(SlabSlots*SlotSize));
+    for (std::size_t i = SlabSlots; i-- > 0;)
+    {
+        Slot* slot = reinterpret_cast<Slot*>(slab + i*SlotSize);
+        slot->next = free;
+        free = slot;
+    }
+    ++slabs;
+}
+
+// Hands all but keep slots of the thread back to the pool.
+template<typename T>
+inline void SlabPool<T>::drain(Cache& local, std::size_t keep) noexcept
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    while (local.size > keep)
+    {
+        Slot* slot = local.free;
+        local.free = slot->next;
+        --local.size;
+        slot->next = free;
+        free = slot;
+    }
+}
+
+}// namespace detail
+}// namespace cow
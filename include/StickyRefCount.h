@@ -0,0 +1,195 @@
+/*
+Copyright(c) 2016 Bjoern Piltz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files(the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+#include "COW.h"
+#include <cassert>
+#include <mutex>
+#include <vector>
+
+namespace cow {
+
+/**
+ * Sticky reference counting: COW<T, cow::sticky<Threshold>>.
+ *
+ * Counts like cow::multi_thread until a payload is referenced by Threshold
+ * handles. Its count then sticks: copying and destroying handles to it
+ * only read the counter, which stays in every core's cache instead of
+ * bouncing between them, and writes detach as usual. This suits payloads
+ * that end up shared very widely, like a default style object.
+ *
+ * Sticky payloads are no longer freed when their last handle goes away.
+ * collect() destroys all of them at once, at a point where the program
+ * knows none of their handles are left, e.g. between the phases of a batch
+ * job or at shutdown. Without a call to collect() they live as long as the
+ * program.
+ *
+ * collect() can't tell whether a stuck payload is still referenced: it
+ * destroys every one of them, and any handle left pointing to one dangles.
+ * Debug builds keep counting stuck payloads and assert that none is.
+ */
+template<int Threshold = 1024>
+struct sticky
+{
+    static_assert(Threshold > 1, "payloads must be counted before they stick");
+
+    typedef std::atomic<int> counter;
+
+    static void increment(counter& count) noexcept;
+    static bool decrement(counter& count) noexcept;
+    static int load(const counter& count) noexcept;
+
+    // Destroys every payload whose count stuck, and returns how many there
+    // were.
+    // PRECONDITION: no handle to any of them is left. Handles that are still
+    // alive, on any thread, dangle after the call.
+    static std::size_t collect() noexcept;
+
+    // The number of payloads whose count stuck since the last collect().
+    static std::size_t stuck() noexcept;
+
+private:
+    // Added to a count when it sticks. Releases that were already under
+    // way when it did can only take a few off it, and retains none.
+    enum { Stuck = 1 << 30 };
+
+    // Debug builds keep counting stuck payloads, so that collect() can
+    // check its precondition.
+#ifdef NDEBUG
+    static const bool Recount = false;
+#else
+    static const bool Recount = true;
+#endif
+
+    typedef detail::BlockHeader<sticky> Header;
+    static void stick(counter& count);
+    static std::mutex& mutex() noexcept;
+    static std::vector<Header*>& headers() noexcept;
+};
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//                    Implementation details follow:                        //
+//////////////////////////////////////////////////////////////////////////////
+
+template<int Threshold>
+inline void sticky<Threshold>::increment(counter& count) noexcept
+{
+    // Reading first keeps the cache line shared once the count stuck.
+    if (count.load(std::memory_order_relaxed) >= Stuck/2)
+    {
+        if (Recount)
+            count.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    if (count.fetch_add(1, std::memory_order_relaxed) + 1 == Threshold)
+    {
+        try
+        {
+            stick(count);
+        }
+        catch (...)
+        {
+            // Out of memory: keep counting instead.
+        }
+    }
+}
+
+template<int Threshold>
+inline bool sticky<Threshold>::decrement(counter& count) noexcept
+{
+    if (count.load(std::memory_order_relaxed) >= Stuck/2)
+    {
+        if (Recount)
+            count.fetch_sub(1, std::memory_order_release);
+        return false;
+    }
+    return count.fetch_sub(1, std::memory_order_acq_rel) == 1;
+}
+
+template<int Threshold>
+inline int sticky<Threshold>::load(const counter& count) noexcept
+{
+    return count.load(std::memory_order_acquire);
+}
+
+template<int Threshold>
+inline void sticky<Threshold>::stick(counter& count)
+{
+    static_assert(std::is_standard_layout<Header>::value, "the counter must be the first member of the header");
+    std::lock_guard<std::mutex> lock(mutex());
+    headers().reserve(headers().size() + 1);// Throws before the count sticks.
+
+    // Releases and retains can bring the count back to Threshold before
+    // this runs, so several threads may get here for the same block. Only
+    // the one that makes it stick registers it. The handle that got here
+    // holds a reference, so the count can't drop to zero meanwhile.
+    int current = count.load(std::memory_order_relaxed);
+    do
+    {
+        if (current >= Stuck/2)
+            return;
+    }
+    while (!count.compare_exchange_weak(current, current + Stuck, std::memory_order_relaxed));
+    headers().push_back(reinterpret_cast<Header*>(&count));
+}
+
+template<int Threshold>
+inline std::size_t sticky<Threshold>::collect() noexcept
+{
+    std::vector<Header*> collected;
+    {
+        std::lock_guard<std::mutex> lock(mutex());
+        collected.swap(headers());
+    }
+    for (Header* header : collected)
+    {
+        assert(header->count.load(std::memory_order_acquire) == Stuck
+            && "sticky::collect() called while handles to a stuck payload are alive");
+        header->destroy(header);
+    }
+    return collected.size();
+}
+
+template<int Threshold>
+inline std::size_t sticky<Threshold>::stuck() noexcept
+{
+    std::lock_guard<std::mutex> lock(mutex());
+    return headers().size();
+}
+
+template<int Threshold>
+inline std::mutex& sticky<Threshold>::mutex() noexcept
+{
+    static std::mutex* mutex = new std::mutex;// Leaked, like the list.
+    return *mutex;
+}
+
+template<int Threshold>
+inline std::vector<typename sticky<Threshold>::Header*>& sticky<Threshold>::headers() noexcept
+{
+    static std::vector<Header*>* headers = new std::vector<Header*>;
+    return *headers;
+}
+
+}// namespace cow
@@ -0,0 +1,94 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+/*
+ * Minimal helpers for the benchmarks in this directory.
+ * They are plain executables, built with the tests and run by 'make bench'.
+*/
+namespace bench
+{
+    // The thread counts to measure: 1, 2, 4, ... up to the number of cores.
+    inline std::vector<unsigned> threadCounts()
+    {
+        const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<unsigned> counts;
+        for (unsigned n = 1; n < cores; n *= 2)
+            counts.push_back(n);
+        counts.push_back(cores);
+        return counts;
+    }
+
+    // Runs body(threadIndex) on the given number of threads and returns
+    // the wall clock time in seconds.
+    template<typename F>
+    double runParallel(unsigned threads, F body)
+    {
+        std::vector<std::thread> pool;
+        const auto start = std::chrono::steady_clock::now();
+        for (unsigned i = 0; i < threads; ++i)
+            pool.emplace_back(body, i);
+        for (auto& thread : pool)
+            thread.join();
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    template<typename F>
+    double run(F body)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        body();
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Keeps the optimizer from discarding a computed value, or the stores
+    // that produced it.
+    template<typename T>
+    inline void doNotOptimize(const T& value)
+    {
+#if defined(__GNUC__)
+        asm volatile("" : : "r"(&value) : "memory");
+#else
+        // A call the compiler can't see through, which may read any memory.
+        static void (*volatile escape)(const void*) = [](const void*) {};
+        escape(&value);
+#endif
+    }
+
+    inline void header(const char* title)
+    {
+        std::printf("\n%s\n", title);
+    }
+
+    // Prints one row of a thread scaling table.
+    inline void reportScaling(const char* name, unsigned threads, double operations, double seconds, double singleThreaded)
+    {
+        const double rate = operations / seconds;
+        std::printf("%-28s %3u threads %10.1f Mops/s  %5.2fx\n",
+            name, threads, rate*1e-6, singleThreaded > 0 ? rate/singleThreaded : 1.0);
+    }
+
+    // Prints a thread scaling table for body(threads), which returns the
+    // seconds it took to run iterations operations on each thread.
+    template<typename F>
+    void scaling(const char* name, int iterations, F body)
+    {
+        double single = 0;
+        for (unsigned threads : threadCounts())
+        {
+            const double operations = double(iterations)*threads;
+            const double seconds = body(threads);
+            if (threads == 1)
+                single = operations/seconds;
+            reportScaling(name, threads, operations, seconds, single);
+        }
+    }
+
+    inline void report(const char* name, double operations, double seconds)
+    {
+        std::printf("%-40s %10.2f ns/op\n", name, seconds*1e9/operations);
+    }
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include "COW.h"
+#include <atomic>
+
+// A payload that counts its live instances, shared by the test suites
+// that check when payloads are copied and destroyed.
+namespace
+{
+    std::atomic<int> alive(0);
+
+    struct Payload
+    {
+        Payload(int value=0) : value(value) { ++alive; }
+        Payload(const Payload& other) : value(other.value) { ++alive; }
+        ~Payload() { --alive; }
+        bool operator==(const Payload& other)const { return value == other.value; }
+        int value;
+    };
+}
+
+// Befriended by COW and cow::compact_handle.
+struct COWInspector
+{
+    template<typename Handle>
+    static int count(const Handle& handle)
+    {
+        return handle.count();
+    }
+};
+
+// The reference count of a handle's payload.
+template<typename Handle>
+static int count(const Handle& handle)
+{
+    return COWInspector::count(handle);
+}
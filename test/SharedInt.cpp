@@ -8,16 +8,19 @@ struct PrivateInt
         : value(0)
     {
         ++referenceCount;
+        ++constructedCount;
     }
-    explicit PrivateInt(int i)
+    explicit PrivateInt(int i) noexcept
         : value(i)
     {
         ++referenceCount;
+        ++constructedCount;
     }
     PrivateInt(const PrivateInt& other)
         : value(other.value)
     {
         ++referenceCount;
+        ++constructedCount;
     }
     ~PrivateInt()
     {
@@ -48,11 +51,13 @@ struct PrivateInt
     static bool allowAllocations;
     static std::atomic<std::size_t>  allocationCount;
     static std::atomic<std::size_t>  referenceCount;
+    static std::atomic<std::size_t>  constructedCount;
 };
 
 bool PrivateInt::allowAllocations = true;
 std::atomic<std::size_t> PrivateInt::allocationCount = { 0 };
 std::atomic<std::size_t> PrivateInt::referenceCount = { 0 };
+std::atomic<std::size_t> PrivateInt::constructedCount = { 0 };
 
 void SharedInt::AllowAllocations(bool on)
 {
@@ -64,6 +69,11 @@ std::size_t SharedInt::ReferenceCount()
     return PrivateInt::referenceCount;
 }
 
+std::size_t SharedInt::ConstructedCount()
+{
+    return PrivateInt::constructedCount;
+}
+
 std::size_t SharedInt::AllocatedCount()
 {
     return PrivateInt::allocationCount;
@@ -85,8 +95,12 @@ int SharedInt::value()const
 
 void SharedInt::setValue(int value)
 {
-    const auto& c(d);
-    if(c->value==value)
+    if(d->value==value)
         return;
-    d->value = value;
+    d.field(&PrivateInt::value) = value;
+}
+
+void SharedInt::reset(int value)
+{
+    d.emplace(value);
 }
@@ -1,6 +1,9 @@
 #pragma once
 #include "COW.h"
 
+// Reads through the non-const handle don't detach.
+template<> struct cow::deferred_detach<struct PrivateInt> : std::true_type {};
+
 class SharedInt
 {
 public:
@@ -9,6 +12,7 @@ public:
 
     int value()const;
     void setValue(int);
+    void reset(int);// Replaces the value without copying it first.
 
 private:
     COW<struct PrivateInt> d;
@@ -16,8 +20,11 @@ private:
     static void AllowAllocations(bool on=true);
     static std::size_t AllocatedCount();
     static std::size_t ReferenceCount();
+    static std::size_t ConstructedCount();
 
     friend class BasicTest_DefaultConstructed_Test;
     friend class BasicTest_StandardUsage_Test;
     friend class BasicTest_Arrays_Test;
+    friend class BasicTest_AssignAndEmplace_Test;
+    friend class BasicTest_DeferredDetach_Test;
 };
@@ -0,0 +1,88 @@
+#include "Benchmark.h"
+#include "Batch.h"
+#include <algorithm>
+#include <cstdio>
+#include <random>
+
+// Detaches a vector of handles copied from another one, either one handle
+// at a time through data(), or with cow::detach_all(), and then iterates
+// over the payloads. Then iterates over the original payloads before and
+// after cow::compact(). The heap is churned first, as in a long running
+// program, so that single allocations don't come out in order by chance.
+
+struct Payload
+{
+    double values[4] = {1, 2, 3, 4};
+};
+
+static const int Size = 1 << 18;
+static const int Passes = 20;
+
+static std::vector<void*> churnHeap()
+{
+    std::vector<void*> blocks(4*Size), kept;
+    for (auto& block : blocks)
+        block = ::operator new(sizeof(Payload) + 16);
+    std::shuffle(blocks.begin(), blocks.end(), std::mt19937(42));
+    for (std::size_t i = 0; i < blocks.size(); ++i)
+    {
+        if (i % 2)
+            kept.push_back(blocks[i]);
+        else
+            ::operator delete(blocks[i]);
+    }
+    return kept;// Freed at the end, so the holes stay scattered.
+}
+
+static double iterate(const std::vector<COW<Payload>>& handles)
+{
+    return bench::run([&handles]
+    {
+        double sum = 0;
+        for (int pass = 0; pass < Passes; ++pass)
+            for (const auto& handle : handles)
+                sum += handle.constData().values[pass % 4];
+        bench::doNotOptimize(sum);
+    });
+}
+
+int main()
+{
+    const std::vector<void*> holes = churnHeap();
+    std::vector<COW<Payload>> original(Size);
+    for (auto& handle : original)
+        handle = COW<Payload>(Payload());
+
+    bench::header("Detaching a copied vector of handles");
+    {
+        std::vector<COW<Payload>> handles = original;
+        bench::report("detach one by one", Size, bench::run([&handles]
+        {
+            for (auto& handle : handles)
+                handle.detach();
+        }));
+        bench::report("  then iterate", double(Size)*Passes, iterate(handles));
+    }
+    {
+        std::vector<COW<Payload>> handles = original;
+        bench::report("cow::detach_all", Size, bench::run([&handles]
+        {
+            cow::detach_all(handles.begin(), handles.end());
+        }));
+        bench::report("  then iterate", double(Size)*Passes, iterate(handles));
+    }
+
+    bench::header("Iterating over scattered payloads");
+    bench::report("before cow::compact", double(Size)*Passes, iterate(original));
+    cow::compact_stats stats = {0, 0};
+    bench::report("cow::compact", Size, bench::run([&original, &stats]
+    {
+        stats = cow::compact(original.begin(), original.end());
+    }));
+    bench::report("after cow::compact", double(Size)*Passes, iterate(original));
+    std::printf("%zu payloads, %zu bytes moved\n", stats.payloads, stats.bytes_moved);
+
+    for (void* block : holes)
+        ::operator delete(block);
+    return 0;
+}
@@ -0,0 +1,60 @@
+#include "Benchmark.h"
+#include "CompactHandle.h"
+#include <cstdio>
+#include <random>
+
+// Scans a large array of handles to a few distinct payloads, like the cells
+// of a spreadsheet referring to their styles, counting the cells that share
+// one style. Only the handles are read, so the scan is bound by their size.
+
+struct Style
+{
+    int font = 0;
+    unsigned color = 0;
+};
+
+static const int Size = 1 << 22;
+static const int Styles = 16;
+static const int Passes = 10;
+
+template<typename Handle, typename Same>
+static void scan(const char* name, Same same)
+{
+    std::vector<Handle> styles;
+    for (int i = 0; i < Styles; ++i)
+    {
+        Style style;
+        style.font = i;
+        styles.emplace_back(style);
+    }
+    std::mt19937 random(42);
+    std::vector<Handle> cells;
+    cells.reserve(Size);
+    for (int i = 0; i < Size; ++i)
+        cells.push_back(styles[random() % Styles]);
+
+    std::printf("%-40s %8.1f MB\n", name, double(sizeof(Handle))*Size/(1 << 20));
+    bench::report("  scan", double(Size)*Passes, bench::run([&]
+    {
+        int matches = 0;
+        for (int pass = 0; pass < Passes; ++pass)
+            for (const Handle& cell : cells)
+                matches += same(cell, styles[pass % Styles]);
+        bench::doNotOptimize(matches);
+    }));
+}
+
+int main()
+{
+    bench::header("Scanning handles for a shared payload");
+    scan<COW<Style>>("COW", [](const COW<Style>& a, const COW<Style>& b)
+    {
+        return &a.constData() == &b.constData();
+    });
+    typedef cow::compact_handle<Style> Compact;
+    scan<Compact>("cow::compact_handle", [](const Compact& a, const Compact& b)
+    {
+        return a.index() == b.index();
+    });
+    return 0;
+}
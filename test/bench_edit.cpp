@@ -0,0 +1,68 @@
+#include "Benchmark.h"
+#include "COW.h"
+
+// Measures the cost per element of writing a whole payload: through the
+// handle's operator->, which checks whether to detach on every access,
+// through one COW::edit() guard, and through a raw pointer.
+
+struct Pixels
+{
+    int values[4096];
+};
+
+static const int Rounds = 20000;
+static const int Size = 4096;
+
+static double throughArrow(COW<Pixels>& image)
+{
+    return bench::run([&image]
+    {
+        for (int round = 0; round < Rounds; ++round)
+        {
+            for (int i = 0; i < Size; ++i)
+                image->values[i] = round + i;
+            bench::doNotOptimize(image);
+        }
+    });
+}
+
+static double throughEdit(COW<Pixels>& image)
+{
+    return bench::run([&image]
+    {
+        for (int round = 0; round < Rounds; ++round)
+        {
+            auto pixels = image.edit();
+            for (int i = 0; i < Size; ++i)
+                pixels->values[i] = round + i;
+            bench::doNotOptimize(*pixels);
+        }
+    });
+}
+
+static double throughPointer(Pixels& raw)
+{
+    return bench::run([&raw]
+    {
+        for (int round = 0; round < Rounds; ++round)
+        {
+            Pixels* pixels = &raw;
+            for (int i = 0; i < Size; ++i)
+                pixels->values[i] = round + i;
+            bench::doNotOptimize(*pixels);
+        }
+    });
+}
+
+int main()
+{
+    const double writes = double(Rounds)*Size;
+    COW<Pixels> image{Pixels()};
+    std::unique_ptr<Pixels> raw(new Pixels());
+
+    bench::header("Writing every element of a payload");
+    bench::report("operator-> per element", writes, throughArrow(image));
+    bench::report("one edit() guard", writes, throughEdit(image));
+    bench::report("raw pointer", writes, throughPointer(*raw));
+    return 0;
+}
@@ -0,0 +1,53 @@
+#include "Benchmark.h"
+#include "AtomicCOW.h"
+
+// Readers of an AtomicCOW from 1 to N threads. load() increments the
+// ticket count of the cell and the payload count when the snapshot is
+// released, so every reader writes to shared cache lines. borrow() inside
+// an epoch_guard only writes to the reader's own epoch record.
+
+struct Table
+{
+    int values[16] = {};
+};
+
+static const int Lookups = 2000000;
+
+int main()
+{
+    AtomicCOW<Table> cell(COW<Table>(Table{}));
+    double single[2] = {0, 0};
+
+    bench::header("AtomicCOW readers: load() snapshots vs. borrow() in an epoch");
+    for (unsigned threads : bench::threadCounts())
+    {
+        const double operations = double(threads)*Lookups;
+
+        const double loaded = bench::runParallel(threads, [&cell](unsigned)
+        {
+            int sum = 0;
+            for (int i = 0; i < Lookups; ++i)
+                sum += cell.load().constData().values[i & 15];
+            bench::doNotOptimize(sum);
+        });
+        const double borrowed = bench::runParallel(threads, [&cell](unsigned)
+        {
+            int sum = 0;
+            for (int i = 0; i < Lookups; ++i)
+            {
+                cow::epoch_guard guard;
+                sum += cell.borrow(guard).values[i & 15];
+            }
+            bench::doNotOptimize(sum);
+        });
+
+        if (threads == 1)
+        {
+            single[0] = operations/loaded;
+            single[1] = operations/borrowed;
+        }
+        bench::reportScaling("load()", threads, operations, loaded, single[0]);
+        bench::reportScaling("borrow()", threads, operations, borrowed, single[1]);
+    }
+    return 0;
+}
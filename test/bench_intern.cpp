@@ -0,0 +1,53 @@
+#include "Benchmark.h"
+#include "InternPool.h"
+#include <algorithm>
+#include <cstdio>
+#include <random>
+
+// Interns a vector of handles that were detached and edited into a small
+// number of distinct values, and reports what that saved.
+
+struct Payload
+{
+    double values[8] = {};
+    bool operator==(const Payload& other)const
+    {
+        return std::equal(values, values + 8, other.values);
+    }
+};
+
+struct Hash
+{
+    std::size_t operator()(const Payload& payload)const
+    {
+        std::size_t hash = 0;
+        for (double value : payload.values)
+            hash = hash*31 + std::hash<double>()(value);
+        return hash;
+    }
+};
+
+static const int Size = 1 << 18;
+static const int Distinct = 1024;
+
+int main()
+{
+    std::mt19937 random(42);
+    const COW<Payload> shared;
+    std::vector<COW<Payload>> handles(Size, shared);
+    for (auto& handle : handles)
+        handle->values[0] = random() % Distinct;
+
+    bench::header("Interning detached payloads");
+    cow::intern_pool<Payload, cow::multi_thread, std::allocator<Payload>, Hash> pool;
+    bench::report("intern", Size, bench::run([&]
+    {
+        for (auto& handle : handles)
+            pool.intern(handle);
+    }));
+
+    const cow::intern_stats stats = pool.stats();
+    std::printf("%zu of %zu handles deduplicated (%.1f%%), %.1f MB saved, %zu payloads pooled\n",
+        stats.deduplicated, stats.interned, 100*stats.ratio(), double(stats.bytes_saved)/(1 << 20), pool.size());
+    return 0;
+}
@@ -0,0 +1,59 @@
+#include "Benchmark.h"
+#include "COW.h"
+
+// Compares the atomic default policy with cow::single_thread on a single
+// thread for copy heavy workloads: copying handles around, then writing to
+// every copy, which detaches it.
+
+struct Payload
+{
+    int values[4] = {0, 0, 0, 0};
+};
+
+static const int Rounds = 2000;
+static const int Size = 1024;
+
+template<typename Policy>
+static double copyAndRelease()
+{
+    const COW<Payload, Policy> source(Payload{});
+    return bench::run([&source]
+    {
+        std::vector<COW<Payload, Policy>> handles(Size);
+        for (int round = 0; round < Rounds; ++round)
+        {
+            for (auto& handle : handles)
+                handle = source;
+            bench::doNotOptimize(handles);
+        }
+    });
+}
+
+template<typename Policy>
+static double copyAndDetach()
+{
+    const COW<Payload, Policy> source(Payload{});
+    return bench::run([&source]
+    {
+        for (int round = 0; round < Rounds/10; ++round)
+        {
+            std::vector<COW<Payload, Policy>> handles(Size, source);
+            for (auto& handle : handles)
+                handle->values[0] = round;
+            bench::doNotOptimize(handles);
+        }
+    });
+}
+
+int main()
+{
+    const double copies = double(Rounds)*Size;
+    const double detaches = double(Rounds/10)*Size;
+
+    bench::header("Refcount policies, single thread");
+    bench::report("copy assign, cow::multi_thread", copies, copyAndRelease<cow::multi_thread>());
+    bench::report("copy assign, cow::single_thread", copies, copyAndRelease<cow::single_thread>());
+    bench::report("copy + detach, cow::multi_thread", detaches, copyAndDetach<cow::multi_thread>());
+    bench::report("copy + detach, cow::single_thread", detaches, copyAndDetach<cow::single_thread>());
+    return 0;
+}
@@ -0,0 +1,43 @@
+#include "Benchmark.h"
+#include "ShardedRefCount.h"
+#include <memory>
+
+// Fan-out: every thread takes a copy of one shared handle and then keeps
+// copying and releasing it, as workers do with shared configuration.
+// Compares the default atomic count, cow::sharded and std::shared_ptr.
+
+struct Payload
+{
+    int values[4] = {0, 0, 0, 0};
+};
+
+static const int Iterations = 2000000;
+
+template<typename Handle>
+static double fanOut(const Handle& source, unsigned threads)
+{
+    return bench::runParallel(threads, [&source](unsigned)
+    {
+        const Handle mine = source;
+        for (int i = 0; i < Iterations; ++i)
+        {
+            Handle copy = mine;
+            bench::doNotOptimize(copy);
+        }
+    });
+}
+
+template<typename Handle>
+static void scaling(const char* name, const Handle& source)
+{
+    bench::scaling(name, Iterations, [&source](unsigned threads) { return fanOut(source, threads); });
+}
+
+int main()
+{
+    bench::header("Fan-out copies of one payload");
+    scaling("COW, cow::multi_thread", COW<Payload>(Payload{}));
+    scaling("COW, cow::sharded<>", COW<Payload, cow::sharded<>>(Payload{}));
+    scaling("std::shared_ptr", std::make_shared<Payload>());
+    return 0;
+}
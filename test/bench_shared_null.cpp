@@ -0,0 +1,54 @@
+#include "Benchmark.h"
+#include "COW.h"
+
+// Default construction of COW handles from several threads at once.
+// All of them point to the immortal shared null, so nothing is counted and
+// the rate should grow linearly with the number of threads. For comparison,
+// copying a handle to an ordinary (counted) payload makes every thread
+// write to the same cache line.
+
+struct Payload
+{
+    int value = 0;
+};
+
+static const int Rounds = 2000;
+static const int Size = 1024;
+
+int main()
+{
+    const COW<Payload> counted(Payload{});
+    double single[2] = {0, 0};
+
+    bench::header("Default construction vs. copies of a shared payload");
+    for (unsigned threads : bench::threadCounts())
+    {
+        const double operations = double(threads)*Rounds*Size;
+
+        const double defaultConstructed = bench::runParallel(threads, [](unsigned)
+        {
+            for (int i = 0; i < Rounds; ++i)
+            {
+                std::vector<COW<Payload>> handles(Size);
+                bench::doNotOptimize(handles);
+            }
+        });
+        const double copied = bench::runParallel(threads, [&counted](unsigned)
+        {
+            for (int i = 0; i < Rounds; ++i)
+            {
+                std::vector<COW<Payload>> handles(Size, counted);
+                bench::doNotOptimize(handles);
+            }
+        });
+
+        if (threads == 1)
+        {
+            single[0] = operations/defaultConstructed;
+            single[1] = operations/copied;
+        }
+        bench::reportScaling("default constructed", threads, operations, defaultConstructed, single[0]);
+        bench::reportScaling("copied (counted)", threads, operations, copied, single[1]);
+    }
+    return 0;
+}
@@ -0,0 +1,68 @@
+#include "Benchmark.h"
+#include "Slab.h"
+
+// Compares detach throughput of payloads allocated from the slab allocator
+// with the same payload allocated through malloc, on 1..N threads. Every
+// iteration copies a shared handle and writes to the copy, so each
+// operation is one allocation and one deallocation.
+
+template<int Tag>
+struct Payload
+{
+    int values[6] = {0, 0, 0, 0, 0, 0};
+};
+
+typedef Payload<0> Malloced;
+typedef Payload<1> Slabbed;
+
+template<> struct cow::slab_allocated<Slabbed> : std::true_type {};
+
+static const int Iterations = 1000000;
+
+template<typename T>
+static double detach(unsigned threads)
+{
+    return bench::runParallel(threads, [](unsigned)
+    {
+        const COW<T> source{T{}};
+        for (int i = 0; i < Iterations; ++i)
+        {
+            COW<T> copy = source;
+            copy->values[0] = i;
+            bench::doNotOptimize(copy);
+        }
+    });
+}
+
+// Keeps a window of live payloads per thread, releasing them in allocation
+// order, so the allocator can't simply hand back the last freed block.
+template<typename T>
+static double window(unsigned threads)
+{
+    return bench::runParallel(threads, [](unsigned)
+    {
+        const COW<T> source{T{}};
+        std::vector<COW<T>> live(256);
+        for (int i = 0; i < Iterations; ++i)
+        {
+            COW<T>& slot = live[i % live.size()];
+            slot = source;
+            slot->values[0] = i;
+        }
+        bench::doNotOptimize(live);
+    });
+}
+
+int main()
+{
+    bench::header("Detach throughput, malloc vs. cow::slab_allocator");
+    bench::scaling("detach, malloc", Iterations, detach<Malloced>);
+    bench::scaling("detach, slab", Iterations, detach<Slabbed>);
+    bench::scaling("detach window, malloc", Iterations, window<Malloced>);
+    bench::scaling("detach window, slab", Iterations, window<Slabbed>);
+
+    const cow::slab_stats stats = cow::slab_statistics<Slabbed>();
+    std::printf("slab: %zu slabs of %zu byte slots, %zu/%zu in use (%.1f%%)\n",
+        stats.slabs, stats.slot_size, stats.in_use, stats.capacity, stats.occupancy()*100);
+    return 0;
+}
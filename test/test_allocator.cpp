@@ -0,0 +1,90 @@
+#include "gtest/gtest.h"
+#include "COW.h"
+#include <string>
+
+namespace
+{
+    // Counts the calls made to each pool.
+    struct Pool
+    {
+        int allocations = 0;
+        int deallocations = 0;
+    };
+
+    template<typename T>
+    struct PoolAllocator
+    {
+        typedef T value_type;
+
+        explicit PoolAllocator(Pool* pool) noexcept : pool(pool) {}
+        template<typename U>
+        PoolAllocator(const PoolAllocator<U>& other) noexcept : pool(other.pool) {}
+
+        T* allocate(std::size_t n)
+        {
+            ++pool->allocations;
+            return static_cast<T*>(::operator new(n*sizeof(T)));
+        }
+        void deallocate(T* p, std::size_t)
+        {
+            ++pool->deallocations;
+            ::operator delete(p);
+        }
+        Pool* pool;
+    };
+
+    template<typename T, typename U>
+    bool operator==(const PoolAllocator<T>& a, const PoolAllocator<U>& b) { return a.pool == b.pool; }
+    template<typename T, typename U>
+    bool operator!=(const PoolAllocator<T>& a, const PoolAllocator<U>& b) { return a.pool != b.pool; }
+
+    typedef COW<std::string, cow::multi_thread, PoolAllocator<std::string>> String;
+}
+
+GTEST_TEST(AllocatorTest, StatefulAllocator)
+{
+    Pool pool;
+    {
+        String a(std::allocator_arg, PoolAllocator<std::string>(&pool), "payload");
+        EXPECT_EQ(1, pool.allocations);
+        EXPECT_EQ(&pool, a.get_allocator().pool);
+
+        // Copies share the payload.
+        String b = a;
+        EXPECT_EQ(1, pool.allocations);
+
+        // Detached copies come from the same pool.
+        b.data() += "!";
+        EXPECT_EQ(2, pool.allocations);
+        EXPECT_EQ(&pool, b.get_allocator().pool);
+        EXPECT_EQ("payload", a.constData());
+        EXPECT_EQ("payload!", b.constData());
+    }
+    EXPECT_EQ(2, pool.deallocations);
+}
+
+GTEST_TEST(AllocatorTest, PoolsStaySeparate)
+{
+    Pool first, second;
+    {
+        String a(std::allocator_arg, PoolAllocator<std::string>(&first), "a");
+        String b(std::allocator_arg, PoolAllocator<std::string>(&second), "b");
+
+        String c = a;
+        c = b;
+        c.data() = "c";
+        EXPECT_EQ(1, first.allocations);
+        EXPECT_EQ(2, second.allocations);
+    }
+    EXPECT_EQ(1, first.deallocations);
+    EXPECT_EQ(2, second.deallocations);
+}
+
+GTEST_TEST(AllocatorTest, DefaultAllocator)
+{
+    // std::allocator is empty and stored without overhead.
+    COW<std::string> a("text");
+    std::allocator<std::string> allocator = a.get_allocator();
+    (void)allocator;
+    EXPECT_EQ(sizeof(void*), sizeof(a));
+}
@@ -0,0 +1,104 @@
+#include "gtest/gtest.h"
+#include "Counted.h"
+#include "Arena.h"
+#include <thread>
+#include <vector>
+
+namespace
+{
+    bool inside(const void* p, const char* buffer, std::size_t size)
+    {
+        return p >= buffer && p < buffer + size;
+    }
+}
+
+GTEST_TEST(ArenaTest, PayloadsGoToTheArena)
+{
+    alignas(16) char buffer[4096];
+    {
+        cow::arena_scope arena(buffer, sizeof(buffer));
+        COW<Payload> a(1);
+        COW<Payload> b = a;
+        b.data().value = 2;
+
+        EXPECT_TRUE(inside(&a.constData(), buffer, sizeof(buffer)));
+        EXPECT_TRUE(inside(&b.constData(), buffer, sizeof(buffer)));
+        EXPECT_EQ(2u, arena.live());
+        EXPECT_EQ(1, a->value);
+        EXPECT_EQ(2, b->value);
+    }
+    EXPECT_EQ(0, alive);
+}
+
+GTEST_TEST(ArenaTest, DestructorsRunOnRelease)
+{
+    cow::arena_scope arena;
+    {
+        std::vector<COW<Payload>> payloads;
+        for (int i = 0; i < 10000; ++i)
+            payloads.emplace_back(i);
+        EXPECT_EQ(10000, alive);
+        EXPECT_EQ(10000u, arena.live());
+    }
+    EXPECT_EQ(0, alive);
+    EXPECT_EQ(0u, arena.live());
+    EXPECT_LT(0u, arena.bytes_used());
+}
+
+GTEST_TEST(ArenaTest, NestedScopes)
+{
+    COW<Payload> outside(1);
+    cow::arena_scope outer;
+    COW<Payload> a(2);
+    {
+        cow::arena_scope inner;
+        COW<Payload> b(3);
+        EXPECT_EQ(1u, outer.live());
+        EXPECT_EQ(1u, inner.live());
+    }
+    // Back to the outer scope.
+    COW<Payload> c(4);
+    EXPECT_EQ(2u, outer.live());
+}
+
+GTEST_TEST(ArenaTest, ReleasedOnOtherThreads)
+{
+    cow::arena_scope arena;
+    {
+        std::vector<COW<Payload>> payloads(1000, COW<Payload>(0));
+        for (auto& payload : payloads)
+            payload.data().value = 1;
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t)
+        {
+            std::vector<COW<Payload>> share(payloads.begin() + t*250, payloads.begin() + (t + 1)*250);
+            threads.emplace_back([](std::vector<COW<Payload>> share) { share.clear(); }, std::move(share));
+        }
+        payloads.clear();
+        for (auto& thread : threads)
+            thread.join();
+    }
+    EXPECT_EQ(0u, arena.live());
+    EXPECT_EQ(0, alive);
+}
+
+GTEST_TEST(ArenaTest, OtherAllocatorsAreNotAffected)
+{
+    cow::arena_scope arena;
+    COW<Payload, cow::multi_thread, std::allocator<char>> a(1);
+    EXPECT_EQ(0u, arena.live());
+}
+
+#ifndef NDEBUG
+GTEST_TEST(ArenaDeathTest, EscapeIsDetected)
+{
+    EXPECT_DEATH(
+    {
+        COW<Payload> escaped;
+        {
+            cow::arena_scope arena;
+            escaped = COW<Payload>(1);
+        }
+    }, "outlived");
+}
+#endif
@@ -0,0 +1,178 @@
+#include "gtest/gtest.h"
+#include "Counted.h"
+#include "AtomicCOW.h"
+#include <thread>
+#include <vector>
+
+namespace
+{
+    typedef Payload Table;
+
+    // Releases the payloads that were replaced while the cell was read in
+    // an epoch section, as every load() is without packed pointers.
+    void collectAll()
+    {
+        for (int i = 0; i < 3; ++i)
+            cow::epoch::collect();
+    }
+}
+
+GTEST_TEST(AtomicTest, LoadStore)
+{
+    {
+        AtomicCOW<Table> cell(COW<Table>(1));
+        const COW<Table> snapshot = cell.load();
+        EXPECT_EQ(1, snapshot->value);
+
+        cell.store(COW<Table>(2));
+        EXPECT_EQ(2, cell.load().constData().value);
+
+        // The snapshot is unaffected, and now the only reference.
+        collectAll();
+        EXPECT_EQ(1, snapshot.constData().value);
+        EXPECT_EQ(1, COWInspector::count(snapshot));
+
+        const COW<Table> old = cell.exchange(COW<Table>(3));
+        collectAll();
+        EXPECT_EQ(2, old->value);
+        EXPECT_EQ(1, COWInspector::count(old));
+        EXPECT_EQ(3, alive);
+    }
+    collectAll();
+    EXPECT_EQ(0, alive);
+}
+
+GTEST_TEST(AtomicTest, DefaultConstructed)
+{
+    const AtomicCOW<int> cell;
+    EXPECT_EQ(0, cell.load().constData());
+}
+
+GTEST_TEST(AtomicTest, ManyLoads)
+{
+    {
+        // More loads than a single batch holds.
+        AtomicCOW<Table> cell(COW<Table>(1));
+        std::vector<COW<Table>> snapshots;
+        for (int i = 0; i < 100000; ++i)
+            snapshots.push_back(cell.load());
+
+        const COW<Table> last = cell.exchange(COW<Table>(2));
+        collectAll();
+        EXPECT_EQ(100000 + 1, COWInspector::count(last));
+        snapshots.clear();
+        EXPECT_EQ(1, COWInspector::count(last));
+    }
+    collectAll();
+    EXPECT_EQ(0, alive);
+}
+
+GTEST_TEST(AtomicTest, CompareExchange)
+{
+    {
+        AtomicCOW<Table> cell(COW<Table>(1));
+        COW<Table> expected = cell.load();
+        COW<Table> stale(1);
+
+        EXPECT_FALSE(cell.compare_exchange(stale, COW<Table>(2)));
+        EXPECT_EQ(&expected.constData(), &stale.constData());
+
+        EXPECT_TRUE(cell.compare_exchange(expected, COW<Table>(3)));
+        EXPECT_EQ(3, cell.load().constData().value);
+    }
+    collectAll();
+    EXPECT_EQ(0, alive);
+}
+
+GTEST_TEST(AtomicTest, Update)
+{
+    {
+        AtomicCOW<Table> cell(COW<Table>(1));
+        const COW<Table> before = cell.load();
+
+        // Nothing written, nothing copied.
+        cell.update([](COW<Table>& table) { EXPECT_EQ(1, table.constData().value); });
+        EXPECT_EQ(&before.constData(), &cell.load().constData());
+        EXPECT_EQ(1, alive);
+
+        const COW<Table> after = cell.update([](COW<Table>& table) { table->value++; });
+        EXPECT_EQ(2, after->value);
+        EXPECT_EQ(1, before->value);
+        EXPECT_EQ(2, alive);
+    }
+    collectAll();
+    EXPECT_EQ(0, alive);
+}
+
+GTEST_TEST(AtomicTest, ConcurrentReadersAndWriters)
+{
+    {
+        AtomicCOW<Table> cell(COW<Table>(0));
+        std::atomic<bool> done(false);
+        std::vector<std::thread> readers;
+        for (int t = 0; t < 4; ++t)
+        {
+            readers.emplace_back([&]
+            {
+                int last = 0;
+                while (!done)
+                {
+                    const COW<Table> snapshot = cell.load();
+                    EXPECT_LE(last, snapshot->value);
+                    last = snapshot->value;
+                }
+            });
+        }
+        std::vector<std::thread> writers;
+        for (int t = 0; t < 2; ++t)
+        {
+            writers.emplace_back([&]
+            {
+                for (int i = 0; i < 2000; ++i)
+                    cell.update([](COW<Table>& table) { table->value++; });
+            });
+        }
+        for (auto& writer : writers)
+            writer.join();
+        done = true;
+        for (auto& reader : readers)
+            reader.join();
+
+        EXPECT_EQ(4000, cell.load().constData().value);
+    }
+    collectAll();
+    EXPECT_EQ(0, alive);
+}
+
+GTEST_TEST(AtomicTest, StalledReaderDoesNotBlockWriters)
+{
+    {
+        AtomicCOW<Table> cell(COW<Table>(0));
+        std::atomic<bool> reading(false), written(false);
+
+        // A reader preempted inside load(), which holds nothing but its
+        // epoch section.
+        std::thread reader([&]
+        {
+            const cow::epoch_guard guard;
+            const Table& table = cell.borrow(guard);
+            reading.store(true);
+            while (!written.load())
+                std::this_thread::yield();
+            EXPECT_EQ(0, table.value);
+        });
+        while (!reading.load())
+            std::this_thread::yield();
+
+        for (int i = 1; i <= 1000; ++i)
+            cell.store(COW<Table>(i));
+        COW<Table> expected = cell.load();
+        EXPECT_TRUE(cell.compare_exchange(expected, COW<Table>(1001)));
+        EXPECT_EQ(1001, cell.load().constData().value);
+
+        written.store(true);
+        reader.join();
+    }
+    collectAll();
+    EXPECT_EQ(0, alive);
+}
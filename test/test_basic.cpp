@@ -30,6 +30,27 @@ GTEST_TEST(BasicTest, DefaultConstructed)
     EXPECT_EQ(b.d.pointer, c.d.pointer);
 }
 
+GTEST_TEST(BasicTest, ImmortalSharedNull)
+{
+    COW<int> a, b;
+
+    // The shared null is never counted.
+    EXPECT_EQ(0, a.count());
+    {
+        COW<int> c(a), d;
+        d = b;
+        EXPECT_EQ(0, a.count());
+    }
+    EXPECT_EQ(0, b.count());
+
+    // Writing to a default constructed object detaches it.
+    a.data() = 1;
+    EXPECT_EQ(1, a.count());
+    EXPECT_EQ(1, a.constData());
+    EXPECT_EQ(0, b.constData());
+    EXPECT_NE(a.pointer, b.pointer);
+}
+
 GTEST_TEST(BasicTest, StandardUsage)
 {
     {
@@ -85,10 +106,9 @@ GTEST_TEST(BasicTest, Arrays)
     SharedInt array[Size];
     EXPECT_EQ(1, SharedInt::ReferenceCount());
 
-    // Check that a single element has the size of two pointers: 
-    // Unfortunately shared_ptr, which the current implementation 
-    // is based on, has the size of two pointers.
-    EXPECT_EQ(2*sizeof(void*), sizeof(array)/Size);
+    // Check that a single element has the size of a single pointer:
+    // the reference count is stored next to the payload.
+    EXPECT_EQ(sizeof(void*), sizeof(array)/Size);
 
     std::vector<SharedInt> vector(100);
     EXPECT_EQ(1, SharedInt::ReferenceCount());
@@ -121,6 +141,28 @@ GTEST_TEST(BasicTest, Count)
     EXPECT_EQ(1, c.count());
 }
 
+GTEST_TEST(BasicTest, SingleThreadPolicy)
+{
+    typedef COW<int, cow::single_thread> Int;
+
+    Int a(2);
+    EXPECT_EQ(1, a.count());
+
+    Int b = a;
+    EXPECT_EQ(2, a.count());
+    EXPECT_EQ(2, b.constData());
+
+    b.data() = 3;
+    EXPECT_EQ(1, a.count());
+    EXPECT_EQ(1, b.count());
+    EXPECT_EQ(2, a.constData());
+    EXPECT_EQ(3, b.constData());
+
+    Int c;
+    EXPECT_EQ(0, c.count());
+    EXPECT_EQ(0, c.constData());
+}
+
 static int ctor_count = 0;
 static int copy_count = 0;
 static int forwarding_count = 0;
@@ -183,6 +225,79 @@ GTEST_TEST(BasicTest, perfectForwarding)
     EXPECT_EQ(2, ctor_count);
     EXPECT_EQ(1, copy_count);
     EXPECT_EQ(1, assignment_count);
+
+    // assign() doesn't copy the shared payload it replaces.
+    c.assign(d.constData());
+    EXPECT_EQ(2, ctor_count);
+    EXPECT_EQ(2, copy_count);
+    EXPECT_EQ(1, assignment_count);
+
+    // c is unique now, so its payload is reused.
+    c.assign(d.constData());
+    EXPECT_EQ(2, ctor_count);
+    EXPECT_EQ(2, copy_count);
+    EXPECT_EQ(2, assignment_count);
+
+    // emplace() constructs once, whether a is shared or not.
+    a.emplace();
+    EXPECT_EQ(3, ctor_count);
+    a.emplace();
+    EXPECT_EQ(4, ctor_count);
+    EXPECT_EQ(2, copy_count);
+    EXPECT_EQ(2, assignment_count);
+}
+
+GTEST_TEST(BasicTest, AssignAndEmplace)
+{
+    {
+        SharedInt x(1), y;
+        y = x;
+        const std::size_t constructed = SharedInt::ConstructedCount();
+
+        // x is shared: one construction, no copy of the old value.
+        x.reset(2);
+        EXPECT_EQ(constructed + 1, SharedInt::ConstructedCount());
+        EXPECT_EQ(2, x.value());
+        EXPECT_EQ(1, y.value());
+
+        // x is unique: assigned in place, without a new block.
+        const void* block = x.d.pointer;
+        x.reset(3);
+        EXPECT_EQ(constructed + 2, SharedInt::ConstructedCount());
+        EXPECT_EQ(block, x.d.pointer);
+        EXPECT_EQ(3, x.value());
+        EXPECT_EQ(2+1, SharedInt::ReferenceCount());
+    }
+    EXPECT_EQ(1, SharedInt::ReferenceCount());
+}
+
+GTEST_TEST(BasicTest, EmplaceReusesUniqueBlock)
+{
+    // Building one may throw, moving it can't.
+    struct Movable
+    {
+        explicit Movable(int value) : value(value) { if (value < 0) throw value; }
+        Movable(const Movable&) = default;
+        Movable(Movable&& other) noexcept : value(other.value) {}
+        int value;
+    };
+
+    COW<Movable> a(1);
+    const Movable* payload = &a.constData();
+    EXPECT_EQ(2, a.emplace(2).value);
+    EXPECT_EQ(payload, &a.constData());
+
+    // A throwing constructor leaves the payload as it was.
+    EXPECT_THROW(a.emplace(-1), int);
+    EXPECT_EQ(payload, &a.constData());
+    EXPECT_EQ(2, a->value);
+
+    // A shared payload is left alone.
+    const COW<Movable> b = a;
+    a.emplace(3);
+    EXPECT_NE(payload, &a.constData());
+    EXPECT_EQ(2, b->value);
+    EXPECT_EQ(3, a->value);
 }
 
 class CopyChecker
@@ -233,3 +348,276 @@ GTEST_TEST(BasicTest, NoNeedLessCopies)
     // Calling modified() on an lvalue will trigger a copy.
     EXPECT_THROW( auto b = a.modified(), int);
 }
+
+GTEST_TEST(BasicTest, DetachWith)
+{
+    struct Tracked
+    {
+        Tracked(int value) : value(value) {}
+        Tracked(const Tracked&) = delete;
+        Tracked(Tracked&& other) : value(other.value) {}
+        Tracked& operator=(const Tracked&) = delete;
+        Tracked& operator=(Tracked&& other) { value = other.value; return *this; }
+        int value;
+    };
+    auto twice = [](const Tracked& source) { return Tracked(source.value*2); };
+
+    // Tracked can't be copied, so detach() wouldn't compile.
+    // A shared payload is replaced by a result built from it.
+    const COW<Tracked> a(21);
+    COW<Tracked> b = a;
+    EXPECT_EQ(42, b.detach_with(twice).value);
+    EXPECT_EQ(21, a.constData().value);
+    EXPECT_NE(&a.constData(), &b.constData());
+
+    // A unique payload stays where it is.
+    const Tracked* address = &b.constData();
+    EXPECT_EQ(84, b.detach_with(twice).value);
+    EXPECT_EQ(address, &b.constData());
+}
+
+GTEST_TEST(BasicTest, Take)
+{
+    COW<std::vector<int>> a(std::vector<int>(1000, 1));
+    const int* buffer = a.constData().data();
+
+    // Shared: the payload is copied, and stays with the other owner.
+    COW<std::vector<int>> b = a;
+    std::vector<int> copy = std::move(b).take();
+    EXPECT_NE(buffer, copy.data());
+    EXPECT_EQ(std::vector<int>(1000, 1), copy);
+    EXPECT_EQ(buffer, a.constData().data());
+    EXPECT_EQ(&COW<std::vector<int>>().constData(), &b.constData());
+
+    // Unique: the payload is moved out, without copying the buffer.
+    std::vector<int> taken = std::move(a).take();
+    EXPECT_EQ(buffer, taken.data());
+    EXPECT_TRUE(a.constData().empty());
+}
+
+GTEST_TEST(BasicTest, Edit)
+{
+    const COW<std::vector<int>> a(std::vector<int>(10, 1));
+    COW<std::vector<int>> b = a;
+    {
+        auto values = b.edit();
+        for (auto& value : *values)
+            value = 2;
+        values->push_back(3);
+    }
+    EXPECT_EQ(std::vector<int>(10, 1), a.constData());
+    EXPECT_EQ(11u, b.constData().size());
+    EXPECT_EQ(2, b.constData().front());
+    EXPECT_EQ(3, b.constData().back());
+}
+
+#ifndef NDEBUG
+GTEST_TEST(BasicDeathTest, CopiedWhileEditing)
+{
+    EXPECT_DEATH(
+    {
+        COW<int> a(1);
+        auto value = a.edit();
+        COW<int> b = a;
+        *value = 2;
+    }, "copied while being edited");
+}
+#endif
+
+struct Deferred { int value = 0; int other = 0; };
+template<> struct cow::deferred_detach<Deferred> : std::true_type {};
+
+GTEST_TEST(BasicTest, DeferredDetach)
+{
+    COW<Deferred> a(Deferred{});
+    COW<Deferred> b = a;
+
+    // Reading through a non-const handle stays on the shared payload.
+    static_assert(std::is_same<decltype(b.operator->()), const Deferred*>::value, "");
+    EXPECT_EQ(0, b->value);
+    EXPECT_EQ(0, b.field(&Deferred::value));
+    EXPECT_EQ(&a.constData(), &b.constData());
+
+    // Assigning to a field detaches.
+    b.field(&Deferred::value) = 1;
+    EXPECT_NE(&a.constData(), &b.constData());
+    EXPECT_EQ(0, a->value);
+    EXPECT_EQ(1, b->value);
+
+    b.field(&Deferred::other) = b.field(&Deferred::value);
+    EXPECT_EQ(1, b->other);
+
+    // Through the SharedInt opaque handle: reading never allocates.
+    SharedInt x(1), y;
+    y = x;
+    const std::size_t constructed = SharedInt::ConstructedCount();
+    y.setValue(1);
+    EXPECT_EQ(constructed, SharedInt::ConstructedCount());
+    y.setValue(2);
+    EXPECT_EQ(constructed + 1, SharedInt::ConstructedCount());
+    EXPECT_EQ(1, x.value());
+}
+
+namespace tiles
+{
+    // Copies deeply, but shares its tiles when a COW detaches.
+    struct Picture
+    {
+        Picture() : tiles(std::make_shared<std::vector<int>>(64, 0)) {}
+        Picture(const Picture& other) : tiles(std::make_shared<std::vector<int>>(*other.tiles)), title(other.title) {}
+        Picture(Picture&&) = default;
+
+        std::shared_ptr<std::vector<int>> tiles;
+        std::string title;
+    };
+
+    Picture cow_clone(const Picture& source)
+    {
+        Picture clone;
+        clone.tiles = source.tiles;
+        clone.title = source.title;
+        return clone;
+    }
+}
+
+GTEST_TEST(BasicTest, CowClone)
+{
+    COW<tiles::Picture> a;
+    a->title = "a";
+    COW<tiles::Picture> b = a;
+    b->title = "b";
+
+    // detach() went through cow_clone, so the tiles are shared.
+    EXPECT_EQ(a.constData().tiles, b.constData().tiles);
+    EXPECT_EQ("a", a.constData().title);
+    EXPECT_EQ("b", b.constData().title);
+
+    // Plain copies of the payload are still deep.
+    tiles::Picture copy = a.constData();
+    EXPECT_NE(a.constData().tiles, copy.tiles);
+
+    // Types without cow_clone use their copy constructor.
+    COW<std::string> c(std::string("c")), d = c;
+    d.data() += "d";
+    EXPECT_EQ("c", c.constData());
+}
+
+GTEST_TEST(BasicTest, Freeze)
+{
+    COW<std::vector<int>> table(std::vector<int>(100, 7));
+    COW<std::vector<int>> earlier = table;
+    table.freeze();
+    EXPECT_TRUE(table.frozen());
+    EXPECT_FALSE(earlier.frozen());// It detached, earlier keeps the original.
+    EXPECT_EQ(0, table.count());
+    {
+        // Copies and destruction don't count.
+        COW<std::vector<int>> a = table, b = a;
+        EXPECT_EQ(0, table.count());
+        EXPECT_EQ(&table.constData(), &b.constData());
+
+        // Writes always detach, even from the only handle.
+        b.data()[0] = 1;
+        EXPECT_FALSE(b.frozen());
+        EXPECT_EQ(7, table.constData()[0]);
+    }
+    COW<std::vector<int>> last = std::move(table);
+    last.data()[0] = 2;
+    EXPECT_EQ(2, last.constData()[0]);
+}
+
+struct Preset
+{
+    constexpr Preset(int gain, int offset) : gain(gain), offset(offset) {}
+    int gain, offset;
+};
+
+static const cow::static_payload<Preset> preset(2, 3);
+static const cow::static_payload<std::string> greeting("hello");
+
+GTEST_TEST(BasicTest, FromStatic)
+{
+    COW<Preset> a = COW<Preset>::fromStatic(preset);
+    EXPECT_EQ(&preset.get(), &a.constData());
+    EXPECT_TRUE(a.frozen());
+    EXPECT_EQ(0, a.count());
+    {
+        COW<Preset> b = a;
+        EXPECT_EQ(0, a.count());
+
+        // Writes detach.
+        b->gain = 4;
+        EXPECT_NE(&preset.get(), &b.constData());
+        EXPECT_EQ(2, preset.get().gain);
+        EXPECT_EQ(4, b.constData().gain);
+    }
+
+    // Payloads that can't be constant initialized work, too.
+    COW<std::string> c = COW<std::string>::fromStatic(greeting);
+    EXPECT_EQ("hello", c.constData());
+    c.data() += "!";
+    EXPECT_EQ("hello", greeting.get());
+}
+
+static int sum(cow::borrowed<std::vector<int>> values)
+{
+    int result = 0;
+    for (int value : *values)
+        result += value;
+    return result;
+}
+
+GTEST_TEST(BasicTest, Borrowed)
+{
+    COW<std::vector<int>> a(std::vector<int>{1, 2, 3});
+
+    // Borrowing doesn't count.
+    EXPECT_EQ(6, sum(a.borrow()));
+    EXPECT_EQ(1, a.count());
+
+    cow::borrowed<std::vector<int>> view = a.borrow();
+    EXPECT_EQ(&a.constData(), &view.get());
+    EXPECT_EQ(3u, view->size());
+
+    // to_owned() shares the payload.
+    COW<std::vector<int>> b = view.to_owned();
+    EXPECT_EQ(2, a.count());
+    EXPECT_EQ(&a.constData(), &b.constData());
+
+    // Handles sharing the payload detach before writing, which leaves the
+    // view as it was.
+    b.data().push_back(4);
+    COW<std::vector<int>> c = a;
+    c.data().push_back(5);
+    EXPECT_EQ(&a.constData(), &view.get());
+    EXPECT_EQ(3u, view->size());
+
+    // Default constructed payloads can be borrowed, too.
+    const COW<std::vector<int>> empty;
+    EXPECT_EQ(0, sum(empty.borrow()));
+}
+
+#ifndef NDEBUG
+GTEST_TEST(BasicDeathTest, BorrowWrittenTo)
+{
+    EXPECT_DEATH(
+    {
+        COW<std::vector<int>> a(std::vector<int>{1, 2, 3});
+        auto view = a.borrow();
+        a.data().push_back(4);
+    }, "borrowed payload was written to");
+}
+
+GTEST_TEST(BasicDeathTest, BorrowOutlivesOwner)
+{
+    EXPECT_DEATH(
+    {
+        cow::borrowed<std::vector<int>>* view;
+        {
+            COW<std::vector<int>> a(std::vector<int>{1, 2, 3});
+            view = new cow::borrowed<std::vector<int>>(a.borrow());
+        }
+        delete view;
+    }, "outlived the payload");
+}
+#endif
@@ -0,0 +1,168 @@
+#include "gtest/gtest.h"
+#include "Counted.h"
+#include "Batch.h"
+#include <thread>
+#include <vector>
+
+GTEST_TEST(BatchTest, Contiguous)
+{
+    {
+        std::vector<COW<Payload>> original;
+        for (int i = 0; i < 100; ++i)
+            original.emplace_back(i);
+
+        std::vector<COW<Payload>> copy = original;
+        cow::detach_all(copy.begin(), copy.end());
+        EXPECT_EQ(200, alive);
+
+        // Laid out in iteration order, with a constant stride.
+        const char* first = reinterpret_cast<const char*>(&copy[0].constData());
+        const std::ptrdiff_t stride = reinterpret_cast<const char*>(&copy[1].constData()) - first;
+        EXPECT_GT(stride, 0);
+        for (int i = 0; i < 100; ++i)
+        {
+            EXPECT_EQ(first + i*stride, reinterpret_cast<const char*>(&copy[i].constData()));
+            EXPECT_EQ(i, copy[i].constData().value);
+            EXPECT_NE(&original[i].constData(), &copy[i].constData());
+        }
+
+        // Writing doesn't detach again.
+        const Payload* address = &copy[5].constData();
+        copy[5]->value = -1;
+        EXPECT_EQ(address, &copy[5].constData());
+        EXPECT_EQ(5, original[5].constData().value);
+
+        // The batch outlives all but one of its payloads.
+        COW<Payload> kept = copy[7];
+        copy.clear();
+        EXPECT_EQ(101, alive);
+        EXPECT_EQ(7, kept.constData().value);
+    }
+    EXPECT_EQ(0, alive);
+}
+
+GTEST_TEST(BatchTest, SharedWithinTheRange)
+{
+    {
+        const COW<Payload> source(1);
+        std::vector<COW<Payload>> handles(10, source);
+        handles.push_back(COW<Payload>(2));// Already unique.
+        const Payload* unique = &handles.back().constData();
+
+        cow::detach_all(handles.begin(), handles.end());
+        EXPECT_EQ(12, alive);
+        EXPECT_EQ(unique, &handles.back().constData());
+        for (int i = 0; i < 10; ++i)
+        {
+            EXPECT_EQ(1, handles[i].constData().value);
+            EXPECT_NE(&source.constData(), &handles[i].constData());
+        }
+
+        // Nothing left to do.
+        cow::detach_all(handles.begin(), handles.end());
+        EXPECT_EQ(12, alive);
+    }
+    EXPECT_EQ(0, alive);
+}
+
+GTEST_TEST(BatchTest, DetachSkipsMovedFrom)
+{
+    {
+        const COW<Payload> source(1);
+        std::vector<COW<Payload>> handles(2, source);
+        COW<Payload> moved(source);
+        handles.push_back(std::move(moved));
+        handles.push_back(std::move(moved));// Moved-from.
+
+        cow::detach_all(handles.begin(), handles.end());
+        EXPECT_EQ(4, alive);
+        for (int i = 0; i < 3; ++i)
+            EXPECT_NE(&source.constData(), &handles[i].constData());
+    }
+    EXPECT_EQ(0, alive);
+}
+
+GTEST_TEST(BatchTest, ReleasedOnOtherThreads)
+{
+    {
+        const COW<Payload> source(1);
+        std::vector<COW<Payload>> handles(1000, source);
+        cow::detach_all(handles.begin(), handles.end());
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t)
+        {
+            std::vector<COW<Payload>> part(handles.begin() + t*250, handles.begin() + (t + 1)*250);
+            threads.emplace_back([](std::vector<COW<Payload>> part) { part.clear(); }, std::move(part));
+        }
+        handles.clear();
+        for (auto& thread : threads)
+            thread.join();
+    }
+    EXPECT_EQ(0, alive);
+}
+
+GTEST_TEST(BatchTest, Compact)
+{
+    {
+        std::vector<COW<Payload>> handles;
+        for (int i = 0; i < 100; ++i)
+            handles.emplace_back(i);
+        const COW<Payload> source(-1);
+        handles[3] = source;// Shared, stays put.
+        const Payload* shared = &handles[3].constData();
+
+        const cow::compact_stats stats = cow::compact(handles.begin(), handles.end());
+        EXPECT_EQ(99u, stats.payloads);
+        EXPECT_EQ(99*sizeof(Payload), stats.bytes_moved);
+        EXPECT_EQ(100, alive);
+        EXPECT_EQ(shared, &handles[3].constData());
+
+        const char* first = reinterpret_cast<const char*>(&handles[0].constData());
+        const std::ptrdiff_t stride = reinterpret_cast<const char*>(&handles[1].constData()) - first;
+        EXPECT_GT(stride, 0);
+        for (int i = 0; i < 100; ++i)
+        {
+            if (i == 3)
+                continue;
+            EXPECT_EQ(first + (i < 3 ? i : i - 1)*stride, reinterpret_cast<const char*>(&handles[i].constData()));
+            EXPECT_EQ(i, handles[i].constData().value);
+        }
+
+        // Still unique, writing doesn't copy.
+        const Payload* address = &handles[5].constData();
+        handles[5]->value = -5;
+        EXPECT_EQ(address, &handles[5].constData());
+        EXPECT_EQ(100, alive);
+
+        // Compacting compacted payloads moves them to a new batch, the old
+        // one goes away with its last payload.
+        EXPECT_EQ(99u, cow::compact(handles.begin(), handles.end()).payloads);
+        EXPECT_EQ(100, alive);
+    }
+    EXPECT_EQ(0, alive);
+}
+
+GTEST_TEST(BatchTest, CompactSkipsWhatCantMove)
+{
+    {
+        std::vector<COW<Payload>> handles;
+        COW<Payload> frozen(1);
+        frozen.freeze();
+        handles.push_back(std::move(frozen));
+        COW<Payload> moved(2);
+        handles.push_back(std::move(moved));
+        handles.push_back(std::move(moved));// Moved-from.
+
+        const cow::compact_stats stats = cow::compact(handles.begin(), handles.end());
+        EXPECT_EQ(1u, stats.payloads);
+        EXPECT_EQ(sizeof(Payload), stats.bytes_moved);
+        EXPECT_EQ(1, handles[0].constData().value);
+        EXPECT_EQ(2, handles[1].constData().value);
+
+        std::vector<COW<Payload, cow::multi_thread, std::allocator<char>>> others;
+        others.emplace_back(3);
+        EXPECT_EQ(0u, cow::compact(others.begin(), others.end()).payloads);
+    }
+    EXPECT_EQ(1, alive);
+    --alive;// The frozen payload is leaked on purpose.
+}
@@ -0,0 +1,216 @@
+#include "gtest/gtest.h"
+#include "Counted.h"
+#include "BiasedRefCount.h"
+#include <memory>
+#include <thread>
+
+namespace
+{
+    typedef COW<Payload, cow::biased> Handle;
+}
+
+GTEST_TEST(BiasedTest, OwnerThread)
+{
+    {
+        Handle a(1);
+        EXPECT_EQ(1, alive);
+
+        Handle b = a, c = b;
+        EXPECT_EQ(3, count(a));
+
+        c.data().value = 2;
+        EXPECT_EQ(2, count(a));
+        EXPECT_EQ(1, count(c));
+        EXPECT_EQ(1, a.constData().value);
+        EXPECT_EQ(2, c.constData().value);
+        EXPECT_EQ(2, alive);
+    }
+    EXPECT_EQ(0, alive);
+}
+
+GTEST_TEST(BiasedTest, CopiedAndReleasedOnOtherThread)
+{
+    {
+        Handle a(1);
+        std::thread([&a]
+        {
+            // Counted in the shared count and released from it.
+            Handle b = a;
+            EXPECT_EQ(2, count(a));
+        }).join();
+        EXPECT_EQ(1, count(a));
+    }
+    EXPECT_EQ(0, alive);
+}
+
+GTEST_TEST(BiasedTest, OwnerReleasesLast)
+{
+    Handle* a = new Handle(1);
+    Handle* b = nullptr;
+    std::thread([&] { b = new Handle(*a); }).join();
+
+    // The owner merges its count when giving up ownership, the shared
+    // count keeps the payload alive.
+    delete a;
+    EXPECT_EQ(1, alive);
+    std::thread([&] { delete b; }).join();
+    EXPECT_EQ(0, alive);
+}
+
+GTEST_TEST(BiasedTest, ReleaseIsQueuedForTheOwner)
+{
+    Handle a(1);
+    Handle* b = new Handle(a);// Counted by the owner.
+    std::thread([&] { delete b; }).join();
+
+    // The other thread could not decrement the owner's count, the release
+    // is applied when the owner gets to it.
+    EXPECT_EQ(2, count(a));
+    cow::biased::collect();
+    EXPECT_EQ(1, count(a));
+    EXPECT_EQ(1, alive);
+
+    // And the payload is unique again.
+    const Payload* before = &a.constData();
+    a.data().value = 2;
+    EXPECT_EQ(before, &a.constData());
+}
+
+GTEST_TEST(BiasedTest, QueuedReleaseOfLastReference)
+{
+    Handle* a = new Handle(1);
+    std::thread([&] { delete a; }).join();
+    EXPECT_EQ(1, alive);
+
+    // Any release on the owner thread applies the queue.
+    Handle(2);
+    EXPECT_EQ(0, alive);
+}
+
+GTEST_TEST(BiasedTest, OwnerExits)
+{
+    Handle* a = nullptr;
+    Handle* b = nullptr;
+    std::thread([&]
+    {
+        a = new Handle(1);
+        b = new Handle(*a);
+    }).join();
+    EXPECT_EQ(2, count(*a));
+
+    // Both references are counted by the exited owner.
+    delete a;
+    EXPECT_EQ(1, alive);
+    delete b;
+    EXPECT_EQ(0, alive);
+}
+
+GTEST_TEST(BiasedTest, Freeze)
+{
+    Handle a(1);
+    a.freeze();
+    EXPECT_EQ(0, count(a));
+    std::thread([&a]
+    {
+        Handle b = a;
+        EXPECT_EQ(0, count(a));
+    }).join();
+
+    // Frozen payloads are never destroyed.
+    {
+        Handle b = a;
+        Handle c = std::move(a);
+    }
+    EXPECT_EQ(1, alive);
+    --alive;// Leaked on purpose, don't let it confuse the other tests.
+}
+
+GTEST_TEST(BiasedTest, Stress)
+{
+    {
+        Handle shared(7);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t)
+        {
+            threads.emplace_back([&shared]
+            {
+                for (int i = 0; i < 10000; ++i)
+                {
+                    Handle copy = shared;
+                    Handle local(i);
+                    Handle other = local;
+                    EXPECT_EQ(7, copy.constData().value);
+                    other.data().value = 1;
+                }
+            });
+        }
+        for (int i = 0; i < 10000; ++i)
+        {
+            Handle copy = shared;
+            EXPECT_EQ(7, copy.constData().value);
+        }
+        for (auto& thread : threads)
+            thread.join();
+        cow::biased::collect();
+        EXPECT_EQ(1, count(shared));
+    }
+    EXPECT_EQ(0, alive);
+}
+
+GTEST_TEST(BiasedTest, UniqueAfterOwnerReleases)
+{
+    {
+        std::unique_ptr<Handle> second;
+        const Payload* payload;
+        std::atomic<bool> handedOver(false), released(false);
+        std::thread owner([&]
+        {
+            std::unique_ptr<Handle> first(new Handle(1));
+            second.reset(new Handle(*first));
+            payload = &first->constData();
+            handedOver.store(true, std::memory_order_release);
+
+            EXPECT_EQ(1, first->constData().value);
+            first.reset();
+            released.store(true, std::memory_order_relaxed);
+        });
+        while (!handedOver.load(std::memory_order_acquire))
+            std::this_thread::yield();
+        while (!released.load(std::memory_order_relaxed))
+            std::this_thread::yield();
+
+        // The owner's reads happen before this write, which reuses the payload.
+        second->data().value = 2;
+        EXPECT_EQ(payload, &second->constData());
+        owner.join();
+    }
+    EXPECT_EQ(0, alive);
+}
+
+GTEST_TEST(BiasedTest, CreatedAfterThreadExit)
+{
+    // Constructed before the thread's record, so destroyed after it.
+    struct Holder
+    {
+        ~Holder()
+        {
+            Handle a(1);
+            Handle b = a;
+            EXPECT_EQ(2, count(a));
+            out->reset(new Handle(b));
+        }
+        std::unique_ptr<Handle>* out = nullptr;
+    };
+
+    std::unique_ptr<Handle> kept;
+    std::thread([&kept]
+    {
+        static thread_local Holder holder;
+        holder.out = &kept;
+        Handle attach(0);// Creates the thread's record.
+    }).join();
+    EXPECT_EQ(1, count(*kept));
+    EXPECT_EQ(1, kept->constData().value);
+    kept.reset();
+    EXPECT_EQ(0, alive);
+}
@@ -0,0 +1,139 @@
+#include "gtest/gtest.h"
+#include "Counted.h"
+#include "CompactHandle.h"
+#include "StickyRefCount.h"
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    typedef cow::compact_handle<Payload> Handle;
+}
+
+GTEST_TEST(CompactHandleTest, Size)
+{
+    EXPECT_EQ(4u, sizeof(Handle));
+    EXPECT_EQ(4u, sizeof(cow::compact_handle<std::string, cow::single_thread>));
+}
+
+GTEST_TEST(CompactHandleTest, SharesAndDetaches)
+{
+    {
+        Handle a(1);
+        EXPECT_EQ(1, alive);
+        EXPECT_EQ(1u, Handle::live());
+
+        Handle b = a, c = b;
+        EXPECT_EQ(3, count(a));
+        EXPECT_EQ(a.index(), c.index());
+        EXPECT_EQ(&a.constData(), &c.constData());
+
+        c->value = 2;
+        EXPECT_EQ(2, count(a));
+        EXPECT_EQ(1, count(c));
+        EXPECT_NE(a.index(), c.index());
+        EXPECT_EQ(1, a.constData().value);
+        EXPECT_EQ(2, c.constData().value);
+        EXPECT_EQ(2, alive);
+        EXPECT_EQ(2u, Handle::live());
+
+        // Unique payloads are written in place.
+        const Payload* address = &c.constData();
+        c.data().value = 3;
+        EXPECT_EQ(address, &c.constData());
+
+        b = c;
+        EXPECT_EQ(1, count(a));
+        EXPECT_EQ(2, count(c));
+        Handle d = std::move(b);
+        EXPECT_EQ(2, count(c));
+    }
+    EXPECT_EQ(0, alive);
+    EXPECT_EQ(0u, Handle::live());
+}
+
+GTEST_TEST(CompactHandleTest, DefaultConstructed)
+{
+    typedef cow::compact_handle<std::string> Strings;
+    Strings a, b;
+    EXPECT_EQ(a.index(), b.index());
+    EXPECT_EQ(0, count(a));// Immortal, like the shared null of COW.
+    EXPECT_EQ(0u, Strings::live());
+    *b.operator->() = "b";
+    EXPECT_NE(a.index(), b.index());
+    EXPECT_TRUE(a.constData().empty());
+    EXPECT_EQ(1u, Strings::live());
+}
+
+GTEST_TEST(CompactHandleTest, SlotsAreReused)
+{
+    typedef cow::compact_handle<std::vector<int>> Vectors;
+    std::vector<Vectors> handles;
+    for (int i = 0; i < 1000; ++i)
+        handles.emplace_back(1, i);
+    std::set<std::uint32_t> used;
+    for (const auto& handle : handles)
+        used.insert(handle.index());
+    EXPECT_EQ(1000u, used.size());
+    EXPECT_EQ(1000u, Vectors::live());
+
+    // Growing the table never moves a payload.
+    const std::vector<int>* first = &handles[0].constData();
+    handles.emplace_back(1, 1000);
+    EXPECT_EQ(first, &handles[0].constData());
+    for (int i = 0; i < 1001; ++i)
+        EXPECT_EQ(i, handles[i].constData()[0]);
+
+    // The last slot freed is taken first.
+    const std::uint32_t freed = handles[10].index();
+    handles.erase(handles.begin() + 10);
+    EXPECT_EQ(1000u, Vectors::live());
+    Vectors reused(1, -1);
+    EXPECT_EQ(freed, reused.index());
+}
+
+GTEST_TEST(CompactHandleTest, Policies)
+{
+    typedef cow::sticky<4> Policy;
+    {
+        cow::compact_handle<Payload, Policy> a(1);
+        std::vector<cow::compact_handle<Payload, Policy>> copies(10, a);
+        EXPECT_EQ(1u, Policy::stuck());
+        copies[0]->value = 2;
+        EXPECT_EQ(2, alive);
+    }
+    EXPECT_EQ(1, alive);
+    EXPECT_EQ(1u, Policy::collect());
+    EXPECT_EQ(0, alive);
+    EXPECT_EQ(0u, (cow::compact_handle<Payload, Policy>::live()));
+}
+
+GTEST_TEST(CompactHandleTest, Threads)
+{
+    {
+        Handle shared(7);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t)
+        {
+            threads.emplace_back([&shared]
+            {
+                for (int i = 0; i < 10000; ++i)
+                {
+                    Handle copy = shared;
+                    Handle local(i);
+                    Handle other = local;
+                    EXPECT_EQ(7, copy.constData().value);
+                    other->value = 1;
+                    EXPECT_EQ(i, local.constData().value);
+                }
+            });
+        }
+        for (auto& thread : threads)
+            thread.join();
+        EXPECT_EQ(1, count(shared));
+    }
+    EXPECT_EQ(0, alive);
+    EXPECT_EQ(0u, Handle::live());
+}
@@ -0,0 +1,100 @@
+#include "gtest/gtest.h"
+#include "Counted.h"
+#include "AtomicCOW.h"
+#include <thread>
+#include <vector>
+
+namespace
+{
+    typedef Payload Table;
+
+    // Keeps collecting until everything retired so far is released.
+    void collectAll()
+    {
+        for (int i = 0; i < 3; ++i)
+            cow::epoch::collect();
+    }
+}
+
+GTEST_TEST(EpochTest, Borrow)
+{
+    {
+        AtomicCOW<Table> cell(COW<Table>(1));
+        {
+            cow::epoch_guard guard;
+            const Table& table = cell.borrow(guard);
+            EXPECT_EQ(1, table.value);
+
+            // Replacing the payload doesn't destroy it while we look at it.
+            cell.store(COW<Table>(2));
+            collectAll();
+            EXPECT_EQ(2, alive);
+            EXPECT_EQ(1, table.value);
+            EXPECT_EQ(2, cell.borrow(guard).value);
+        }
+        collectAll();
+        EXPECT_EQ(1, alive);
+    }
+    EXPECT_EQ(0, alive);
+}
+
+GTEST_TEST(EpochTest, NestedGuards)
+{
+    AtomicCOW<Table> cell(COW<Table>(1));
+    cow::epoch_guard outer;
+    const Table& table = cell.borrow(outer);
+    {
+        cow::epoch_guard inner;
+        EXPECT_EQ(&table, &cell.borrow(inner));
+    }
+    cell.store(COW<Table>(2));
+    collectAll();
+
+    // Still protected by the outer guard.
+    EXPECT_EQ(1, table.value);
+}
+
+GTEST_TEST(EpochTest, ExchangedValueOutlivesTheEpoch)
+{
+    {
+        AtomicCOW<Table> cell(COW<Table>(1));
+        cow::epoch_guard guard;
+        cell.borrow(guard);
+
+        const COW<Table> old = cell.exchange(COW<Table>(2));
+        EXPECT_EQ(1, old->value);
+    }
+    collectAll();
+    EXPECT_EQ(0, alive);
+}
+
+GTEST_TEST(EpochTest, ConcurrentBorrowers)
+{
+    {
+        AtomicCOW<Table> cell(COW<Table>(0));
+        std::atomic<bool> done(false);
+        std::vector<std::thread> readers;
+        for (int t = 0; t < 4; ++t)
+        {
+            readers.emplace_back([&]
+            {
+                int last = 0;
+                while (!done)
+                {
+                    cow::epoch_guard guard;
+                    const Table& table = cell.borrow(guard);
+                    EXPECT_LE(last, table.value);
+                    last = table.value;
+                }
+            });
+        }
+        for (int i = 0; i < 2000; ++i)
+            cell.update([](COW<Table>& table) { table->value++; });
+        done = true;
+        for (auto& reader : readers)
+            reader.join();
+        EXPECT_EQ(2000, cell.load().constData().value);
+    }
+    collectAll();
+    EXPECT_EQ(0, alive);
+}
@@ -0,0 +1,66 @@
+#include "gtest/gtest.h"
+#include "COW.h"
+#include <string>
+
+namespace
+{
+    struct Point
+    {
+        int x = 1, y = 2;
+    };
+
+    struct Large
+    {
+        char data[64];
+    };
+}
+
+template<> struct cow::inline_storage<Point> : cow::fits_inline<Point> {};
+
+GTEST_TEST(InlineTest, Traits)
+{
+    EXPECT_TRUE(cow::fits_inline<int>::value);
+    EXPECT_TRUE(cow::fits_inline<Point>::value);
+    EXPECT_FALSE(cow::fits_inline<Large>::value);
+    EXPECT_TRUE((cow::fits_inline<Large, 64>::value));
+
+    // Opt in only.
+    EXPECT_FALSE(cow::inline_storage<int>::value);
+    EXPECT_TRUE(cow::inline_storage<Point>::value);
+}
+
+GTEST_TEST(InlineTest, StoredInTheHandle)
+{
+    EXPECT_EQ(sizeof(Point), sizeof(COW<Point>));
+
+    COW<Point> a;
+    EXPECT_EQ(1, a->x);
+    EXPECT_EQ(2, a->y);
+
+    const COW<Point> b(Point{});
+    EXPECT_NE(&a.constData(), &b.constData());
+}
+
+GTEST_TEST(InlineTest, CopiedByValue)
+{
+    COW<Point> a;
+    a->x = 10;
+
+    COW<Point> b = a;
+    EXPECT_EQ(10, b->x);
+
+    b.data().x = 20;
+    EXPECT_EQ(10, a.constData().x);
+    EXPECT_EQ(20, b.constData().x);
+
+    a.detach();
+    a.swap(std::move(b));
+    EXPECT_EQ(20, a->x);
+    EXPECT_EQ(10, b->x);
+}
+
+GTEST_TEST(InlineTest, SharedPayloadsAreUnaffected)
+{
+    EXPECT_EQ(sizeof(void*), sizeof(COW<Large>));
+    EXPECT_EQ(sizeof(void*), sizeof(COW<std::string>));
+}
@@ -0,0 +1,166 @@
+#include "gtest/gtest.h"
+#include "Counted.h"
+#include "InternPool.h"
+#include "Arena.h"
+#include "Batch.h"
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    struct Hash
+    {
+        std::size_t operator()(const Payload& payload)const { return std::hash<int>()(payload.value); }
+    };
+
+    typedef COW<Payload> Handle;
+    typedef cow::intern_pool<Payload, cow::multi_thread, std::allocator<Payload>, Hash> Pool;
+}
+
+GTEST_TEST(InternPoolTest, Deduplicates)
+{
+    {
+        Pool pool;
+        Handle a(1), b(1), c(2);
+        EXPECT_FALSE(pool.intern(a));
+        EXPECT_TRUE(pool.intern(b));
+        EXPECT_FALSE(pool.intern(c));
+        EXPECT_EQ(&a.constData(), &b.constData());
+        EXPECT_EQ(2, alive);
+        EXPECT_EQ(2u, pool.size());
+
+        // Interning again changes nothing.
+        EXPECT_FALSE(pool.intern(b));
+
+        const cow::intern_stats stats = pool.stats();
+        EXPECT_EQ(4u, stats.interned);
+        EXPECT_EQ(1u, stats.deduplicated);
+        EXPECT_LT(sizeof(Payload), stats.bytes_saved);
+        EXPECT_DOUBLE_EQ(0.25, stats.ratio());
+    }
+    EXPECT_EQ(0, alive);
+}
+
+GTEST_TEST(InternPoolTest, SharedDuplicatesAreNotFreed)
+{
+    Pool pool;
+    Handle a(1), b(1);
+    const Handle other = b;
+    pool.intern(a);
+    EXPECT_TRUE(pool.intern(b));
+    EXPECT_EQ(&a.constData(), &b.constData());
+    EXPECT_NE(&a.constData(), &other.constData());
+    EXPECT_EQ(0u, pool.stats().bytes_saved);
+}
+
+GTEST_TEST(InternPoolTest, PooledPayloadsNeverChange)
+{
+    Pool pool;
+    Handle a(1);
+    pool.intern(a);
+    const Payload* pooled = &a.constData();
+
+    // The pool's reference makes the write detach, although a is the only
+    // handle.
+    a->value = 2;
+    EXPECT_NE(pooled, &a.constData());
+
+    Handle b(1);
+    EXPECT_TRUE(pool.intern(b));
+    EXPECT_EQ(pooled, &b.constData());
+    EXPECT_EQ(1, b.constData().value);
+}
+
+GTEST_TEST(InternPoolTest, UnreferencedEntriesAreDropped)
+{
+    {
+        Pool pool;
+        {
+            Handle a(1), b(2);
+            pool.intern(a);
+            pool.intern(b);
+        }
+        EXPECT_EQ(2, alive);
+        EXPECT_EQ(2u, pool.purge());
+        EXPECT_EQ(0, alive);
+        EXPECT_EQ(0u, pool.size());
+
+        // intern() purges as the pool grows.
+        for (int i = 0; i < 10000; ++i)
+        {
+            Handle temporary(i);
+            pool.intern(temporary);
+        }
+        EXPECT_GE(128u, pool.size());
+    }
+    EXPECT_EQ(0, alive);
+}
+
+GTEST_TEST(InternPoolTest, BatchedPayloadsArePooled)
+{
+    {
+        Pool pool;
+        const Handle source(1);
+        std::vector<Handle> handles(100, source);
+        cow::detach_all(handles.begin(), handles.end());
+        for (auto& handle : handles)
+            pool.intern(handle);
+        EXPECT_EQ(99u, pool.stats().deduplicated);
+        EXPECT_EQ(1u, pool.size());
+    }
+    EXPECT_EQ(0, alive);
+}
+
+GTEST_TEST(InternPoolTest, ScopedPayloadsAreNotPooled)
+{
+    Pool pool;
+    {
+        cow::arena_scope arena;
+        Handle a(1), b(1);
+        EXPECT_FALSE(pool.intern(a));
+        EXPECT_FALSE(pool.intern(b));
+        EXPECT_EQ(0u, pool.size());
+    }
+    EXPECT_EQ(0, alive);
+}
+
+GTEST_TEST(InternPoolTest, StandardHash)
+{
+    cow::intern_pool<std::string> pool;
+    COW<std::string> a("text"), b(std::string("te") + "xt");
+    pool.intern(a);
+    EXPECT_TRUE(pool.intern(b));
+    EXPECT_EQ(&a.constData(), &b.constData());
+}
+
+GTEST_TEST(InternPoolTest, Threads)
+{
+    {
+        Pool pool;
+        std::vector<std::vector<Handle>> results(4);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t)
+        {
+            threads.emplace_back([&pool](std::vector<Handle>& handles)
+            {
+                for (int i = 0; i < 1000; ++i)
+                {
+                    handles.emplace_back(i % 10);
+                    pool.intern(handles.back());
+                }
+            }, std::ref(results[t]));
+        }
+        for (auto& thread : threads)
+            thread.join();
+
+        std::set<const Payload*> distinct;
+        for (const auto& handles : results)
+            for (const auto& handle : handles)
+                distinct.insert(&handle.constData());
+        EXPECT_EQ(10u, distinct.size());
+        EXPECT_EQ(4000u - 10, pool.stats().deduplicated);
+    }
+    EXPECT_EQ(0, alive);
+}
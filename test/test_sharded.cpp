@@ -0,0 +1,77 @@
+#include "gtest/gtest.h"
+#include "Counted.h"
+#include "ShardedRefCount.h"
+#include <thread>
+#include <vector>
+
+namespace
+{
+    typedef COW<Payload, cow::sharded<4>> Handle;
+}
+
+GTEST_TEST(ShardedTest, SingleThread)
+{
+    {
+        Handle a(1);
+        Handle b = a, c = b;
+        EXPECT_EQ(3, count(a));
+
+        c.data().value = 2;
+        EXPECT_EQ(2, count(a));
+        EXPECT_EQ(1, count(c));
+        EXPECT_EQ(1, a.constData().value);
+        EXPECT_EQ(2, alive);
+    }
+    EXPECT_EQ(0, alive);
+}
+
+GTEST_TEST(ShardedTest, ReleasedOnOtherThread)
+{
+    {
+        Handle a(1);
+        Handle b = a;
+        std::thread([&b]
+        {
+            // Counted in this thread's slot, released from the creator's.
+            Handle c = b;
+            {
+                Handle released = std::move(b);
+            }
+            EXPECT_EQ(2, count(c));
+        }).join();
+        EXPECT_EQ(1, count(a));
+
+        // a is unique again, so writing doesn't copy.
+        a.data().value = 3;
+        EXPECT_EQ(1, alive);
+    }
+    EXPECT_EQ(0, alive);
+}
+
+GTEST_TEST(ShardedTest, Stress)
+{
+    {
+        const Handle source(1);
+        std::vector<Handle> handed(8, source);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 8; ++t)
+        {
+            threads.emplace_back([&handed, t]
+            {
+                // Released here, after being counted on the main thread.
+                Handle mine = std::move(handed[t]);
+                for (int i = 0; i < 20000; ++i)
+                {
+                    Handle copy = mine;
+                    if (i % 1000 == 0)
+                        copy.data().value = i;
+                }
+            });
+        }
+        for (auto& thread : threads)
+            thread.join();
+        EXPECT_EQ(1, count(source));
+        EXPECT_EQ(1, source.constData().value);
+    }
+    EXPECT_EQ(0, alive);
+}
@@ -0,0 +1,155 @@
+#include "gtest/gtest.h"
+#include "Slab.h"
+#include <set>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    struct Message
+    {
+        int id;
+        double values[3];
+    };
+
+    // The same size and alignment as Message.
+    struct Reading
+    {
+        int sensor;
+        double samples[3];
+    };
+
+    struct Plain
+    {
+        int id;
+    };
+}
+
+template<> struct cow::slab_allocated<Message> : std::true_type {};
+template<> struct cow::slab_allocated<Reading> : std::true_type {};
+
+GTEST_TEST(SlabTest, TraitSelectsSlabAllocator)
+{
+    static_assert(std::is_same<decltype(COW<Message>().get_allocator()), cow::slab_allocator<Message>>::value,
+        "slab_allocated types default to the slab allocator");
+    static_assert(std::is_same<decltype(COW<Plain>().get_allocator()), std::allocator<Plain>>::value,
+        "other types are unaffected");
+    static_assert(std::is_empty<cow::slab_allocator<Message>>::value, "the allocator is stateless");
+}
+
+GTEST_TEST(SlabTest, InUse)
+{
+    const std::size_t before = cow::slab_statistics<Message>().in_use;
+    {
+        std::vector<COW<Message>> handles;
+        for (int i = 0; i < 100; ++i)
+            handles.emplace_back(Message{i, {}});
+        EXPECT_EQ(before + 100, cow::slab_statistics<Message>().in_use);
+
+        // Copies share the payload, detaching allocates.
+        COW<Message> copy = handles.front();
+        EXPECT_EQ(before + 100, cow::slab_statistics<Message>().in_use);
+        copy->id = -1;
+        EXPECT_EQ(before + 101, cow::slab_statistics<Message>().in_use);
+        EXPECT_EQ(0, handles.front().constData().id);
+    }
+    const cow::slab_stats stats = cow::slab_statistics<Message>();
+    EXPECT_EQ(before, stats.in_use);
+    EXPECT_LE(101u, stats.capacity);
+    EXPECT_GT(stats.slabs, 0u);
+    EXPECT_GE(stats.slot_size, sizeof(Message));
+}
+
+GTEST_TEST(SlabTest, PoolPerType)
+{
+    static_assert(sizeof(Message) == sizeof(Reading), "the types share a size class");
+    const std::size_t messages = cow::slab_statistics<Message>().in_use;
+    const std::size_t readings = cow::slab_statistics<Reading>().in_use;
+    {
+        std::vector<COW<Reading>> handles(10);
+        for (int i = 0; i < 10; ++i)
+            handles[i] = COW<Reading>(Reading{i, {}});
+        EXPECT_EQ(messages, cow::slab_statistics<Message>().in_use);
+        EXPECT_EQ(readings + 10, cow::slab_statistics<Reading>().in_use);
+    }
+    EXPECT_EQ(readings, cow::slab_statistics<Reading>().in_use);
+}
+
+GTEST_TEST(SlabTest, SlotsAreReused)
+{
+    std::set<const Message*> seen;
+    for (int i = 0; i < 10; ++i)
+    {
+        COW<Message> handle(Message{i, {}});
+        seen.insert(&handle.constData());
+    }
+    EXPECT_EQ(1u, seen.size());
+}
+
+GTEST_TEST(SlabTest, FreedOnOtherThreads)
+{
+    const std::size_t before = cow::slab_statistics<Message>().in_use;
+    std::vector<COW<Message>> handles;
+    for (int i = 0; i < 1000; ++i)
+        handles.emplace_back(Message{i, {}});
+
+    // Released on a different thread, which hands its cache back on exit.
+    std::thread consumer([&handles]
+    {
+        for (auto& handle : handles)
+            handle = COW<Message>();
+    });
+    consumer.join();
+    EXPECT_EQ(before, cow::slab_statistics<Message>().in_use);
+
+    // The returned slots are allocated again without growing the pool.
+    const std::size_t slabs = cow::slab_statistics<Message>().slabs;
+    for (int i = 0; i < 1000; ++i)
+        handles[i] = COW<Message>(Message{i, {}});
+    EXPECT_EQ(slabs, cow::slab_statistics<Message>().slabs);
+}
+
+GTEST_TEST(SlabTest, Threads)
+{
+    const std::size_t before = cow::slab_statistics<Message>().in_use;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+    {
+        threads.emplace_back([t]
+        {
+            const COW<Message> source(Message{t, {}});
+            for (int i = 0; i < 10000; ++i)
+            {
+                COW<Message> copy = source;
+                copy->id = i;
+                EXPECT_EQ(t, source.constData().id);
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    EXPECT_EQ(before, cow::slab_statistics<Message>().in_use);
+}
+
+GTEST_TEST(SlabTest, ReleasedAfterThreadCacheIsGone)
+{
+    // Constructed before the thread's cache, so destroyed after it.
+    struct Holder
+    {
+        ~Holder()
+        {
+            handle = COW<Message>();
+            COW<Message> late(Message{2, {}});
+            EXPECT_EQ(2, late.constData().id);
+        }
+        COW<Message> handle;
+    };
+
+    const std::size_t before = cow::slab_statistics<Message>().in_use;
+    std::thread([]
+    {
+        static thread_local Holder holder;
+        holder.handle = COW<Message>(Message{1, {}});
+    }).join();
+    EXPECT_EQ(before, cow::slab_statistics<Message>().in_use);
+}
@@ -0,0 +1,111 @@
+#include "gtest/gtest.h"
+#include "Counted.h"
+#include "StickyRefCount.h"
+#include <thread>
+#include <vector>
+
+namespace
+{
+    typedef cow::sticky<8> Policy;
+    typedef COW<Payload, Policy> Handle;
+}
+
+GTEST_TEST(StickyTest, CountsBelowThreshold)
+{
+    {
+        Handle a(1);
+        std::vector<Handle> copies(6, a);
+        EXPECT_EQ(1, alive);
+
+        copies[0].data().value = 2;
+        EXPECT_EQ(2, alive);
+        EXPECT_EQ(1, a.constData().value);
+    }
+    EXPECT_EQ(0, alive);
+    EXPECT_EQ(0u, Policy::stuck());
+}
+
+GTEST_TEST(StickyTest, SticksAtThreshold)
+{
+    {
+        Handle a(1);
+        std::vector<Handle> copies(7, a);
+        EXPECT_EQ(1u, Policy::stuck());
+
+        // Writes still detach.
+        copies[0].data().value = 2;
+        EXPECT_EQ(2, alive);
+        EXPECT_EQ(1, a.constData().value);
+
+        // Copies don't touch the count any more.
+        std::vector<Handle> more(100, a);
+    }
+    // The sticky payload outlives its handles, until collected.
+    EXPECT_EQ(1, alive);
+    EXPECT_EQ(1u, Policy::collect());
+    EXPECT_EQ(0, alive);
+    EXPECT_EQ(0u, Policy::stuck());
+}
+
+GTEST_TEST(StickyTest, Threads)
+{
+    {
+        const Handle source(1);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t)
+        {
+            threads.emplace_back([&source]
+            {
+                for (int i = 0; i < 10000; ++i)
+                {
+                    std::vector<Handle> copies(16, source);
+                    EXPECT_EQ(1, copies.back().constData().value);
+                }
+            });
+        }
+        for (auto& thread : threads)
+            thread.join();
+    }
+    EXPECT_EQ(1u, Policy::collect());
+    EXPECT_EQ(0, alive);
+}
+
+GTEST_TEST(StickyTest, SticksOnce)
+{
+    // Handles copied and released on other threads take the count across
+    // the threshold many times before one of them makes it stick.
+    for (int round = 0; round < 200; ++round)
+    {
+        {
+            const Handle source(round);
+            std::vector<Handle> held(6, source);
+            std::vector<std::thread> threads;
+            for (int t = 0; t < 4; ++t)
+            {
+                threads.emplace_back([&source]
+                {
+                    for (int i = 0; i < 100; ++i)
+                        Handle(source).constData();
+                });
+            }
+            for (auto& thread : threads)
+                thread.join();
+        }
+        EXPECT_EQ(1u, Policy::stuck());
+        EXPECT_EQ(1u, Policy::collect());
+        EXPECT_EQ(0, alive);
+    }
+}
+
+#ifndef NDEBUG
+GTEST_TEST(StickyDeathTest, CollectWithLiveHandlesIsDetected)
+{
+    EXPECT_DEATH(
+    {
+        const Handle a(1);
+        std::vector<Handle> copies(7, a);
+        copies.clear();
+        Policy::collect();
+    }, "alive");
+}
+#endif
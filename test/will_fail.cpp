@@ -44,4 +44,13 @@ GTEST_TEST(WillFail, NotDefinedType)
     // error C2079: 'COW<ForwardDeclaration>::SharedNull::data' uses undefined struct 'ForwardDeclaration'
     ForwardDeclaration object;
 }
+#elif FAIL_LEVEL==4
+struct Deferred { int data=0; };
+template<> struct cow::deferred_detach<Deferred> : std::true_type {};
+
+GTEST_TEST(WillFail, WriteThroughDeferredArrow)
+{
+    COW<Deferred> d;
+    d->data = 1;// Error: writes need data(), edit() or field()
+}
 #endif